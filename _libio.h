@@ -3,18 +3,21 @@
 
 #include "libio.h"
 
-/* IOPAR definitions */
-struct iopar {
-	int id;
-	int state;
-#define ST_DIRTY	0x01
-#define ST_PRESENT	0x08 /* parameter has real data */
-	char *name;
-	double value;
+struct iopar;
+
+/* type methods, shared by all parameters of 1 type */
+struct iopar_ops {
 	void (*del)(struct iopar *);
 	int (*set)(struct iopar *, double value);
 	/* method to refresh value just before get */
 	void (*jitget)(struct iopar *);
+};
+
+/* IOPAR definitions */
+struct iopar {
+	int id;
+	const struct iopar_ops *ops;
+	char *name;
 	/* direct event notification */
 	struct iopar_notifier {
 		struct iopar_notifier *next;
@@ -23,27 +26,171 @@ struct iopar {
 	} *notifiers;
 };
 
+/*
+ * registry of parameters
+ * The value & state of the parameters are kept in arrays, indexed by id,
+ * so scanning them touches only a few cache lines.
+ */
+struct libio_registry {
+	struct iopar **table;
+	double *values;
+	int *states;
+#define ST_DIRTY	0x01
+#define ST_NOTIFIED	0x02 /* notifiers ran for this change */
+#define ST_QUEUED	0x04 /* on the dirty list */
+#define ST_PRESENT	0x08 /* parameter has real data */
+#define ST_JITGET	0x10 /* ops->jitget is set, see iopar_set_ops */
+	struct iopar_stats *stats;
+	/* libt_now() of the event that caused the last change */
+	double *origins;
+	struct iopar_latency **latencies;
+	/* origin of the change being processed, 0 when unknown */
+	double origin;
+	/* changed parameters, in order of change, 0 terminates */
+	int *dirtynext;
+	int dirty, dirtylast;
+	int tablesize, tablespot;
+	/* ids that iopar_init assigned during create_libiopar */
+	int *pending;
+	int npending, spending;
+	struct netio *netio;
+	/* expr parameters to evaluate, in level order */
+	struct exprpar *exprpending;
+	/* gpio chips & requests of this registry */
+	struct gpiochip *gpiochips;
+	struct gpioreq *gpioreqs;
+	/* hold gpio output writes, see gpio_hold_outputs */
+	int gpioheld;
+	/* published values for other threads, see libio_share_registry */
+	struct libio_shared *shared;
+};
+
+/* current registry of this thread */
+extern __thread struct libio_registry *libio_reg;
+
+#define iopar_value(iopar)	(libio_reg->values[(iopar)->id])
+#define iopar_state(iopar)	(libio_reg->states[(iopar)->id])
+
+/* assign an id to a new @iopar, before using iopar_value() */
+extern void iopar_init(struct iopar *iopar, const struct iopar_ops *ops);
+
+/* switch the type methods of @iopar */
+static inline void iopar_set_ops(struct iopar *iopar, const struct iopar_ops *ops)
+{
+	iopar->ops = ops;
+	/* get_iopar tests this, instead of loading the struct */
+	if (ops->jitget)
+		iopar_state(iopar) |= ST_JITGET;
+	else
+		iopar_state(iopar) &= ~ST_JITGET;
+}
+
+/* put @iopar on the dirty list */
+extern void iopar_queue_dirty(struct iopar *iopar);
+
+/* set the origin of @iopar's change, after iopar_set_dirty */
+static inline void iopar_set_origin(struct iopar *iopar, double origin)
+{
+	libio_reg->origins[iopar->id] = origin;
+}
+
 static inline void iopar_set_dirty(struct iopar *iopar)
 {
-	iopar->state |= ST_DIRTY;
+	iopar_state(iopar) = (iopar_state(iopar) | ST_DIRTY) & ~ST_NOTIFIED;
+	if (!(iopar_state(iopar) & ST_QUEUED))
+		iopar_queue_dirty(iopar);
 }
 
 static inline void iopar_set_present(struct iopar *iopar)
 {
-	if (!(iopar->state & ST_PRESENT))
-		iopar->state |= ST_PRESENT | ST_DIRTY;
+	if (!(iopar_state(iopar) & ST_PRESENT)) {
+		iopar_state(iopar) |= ST_PRESENT;
+		iopar_set_dirty(iopar);
+	}
 }
 
 static inline void iopar_clr_present(struct iopar *iopar)
 {
-	if (iopar->state & ST_PRESENT)
-		iopar->state = (iopar->state | ST_DIRTY) & ~ST_PRESENT;
+	if (iopar_state(iopar) & ST_PRESENT) {
+		iopar_state(iopar) &= ~ST_PRESENT;
+		iopar_set_dirty(iopar);
+	}
 }
 
+/* attribute handles, see attr.c
+ * @oflags O_RDWR falls back to O_RDONLY or O_WRONLY for such attributes
+ */
+struct attr;
+extern struct attr *attr_open(const char *path, int oflags);
+extern void attr_close(struct attr *attr);
+extern const char *attr_path(const struct attr *attr);
+/* current fd, -1 while closed, a reopen returns another fd */
+extern int attr_fd(const struct attr *attr);
+/* read the whole file, into a buffer of @attr */
+extern const char *attr_pread(struct attr *attr);
+/* read the whole file via libe_pread, so the reads of 1 loop iteration
+ * go out together. @done gets the contents, or NULL with errno set.
+ * While a read is queued, the next ones are dropped,
+ * and attr_close frees @attr only after it completed.
+ */
+extern int attr_pread_queue(struct attr *attr,
+		void (*done)(const char *buf, void *dat), void *dat);
+extern int attr_pwrite(struct attr *attr, const char *str, int len);
+extern int attr_pwritef(struct attr *attr, const char *fmt, ...)
+	__attribute__((format(printf,2,3)));
+
+/* periodic polls, those with equal @delay share 1 timer */
+extern void libio_add_poll(double delay, void (*fn)(void *), void *dat);
+/* poll between @min and @max, see libio_poll_adapt */
+extern void libio_add_adaptive_poll(double min, double max,
+		void (*fn)(void *), void *dat);
+extern void libio_remove_poll(void (*fn)(void *), void *dat);
+extern int libio_poll_exist(void (*fn)(void *), void *dat);
+/* after a poll: return to min on a change, or double the delay
+ * up to max. Returns the new delay.
+ */
+extern double libio_poll_adapt(void (*fn)(void *), void *dat, int changed);
+/* poll groups of the current loop */
+struct pollgroup;
+extern struct pollgroup **libio_loop_pollgroups(void);
+extern void free_pollgroups(struct pollgroup *groups);
+
+/* account a poll of @iopar, that repeats after @interval,
+ * 0 for a read on demand
+ */
+static inline void iopar_polled(struct iopar *iopar, double interval)
+{
+	++libio_reg->stats[iopar->id].npolls;
+	libio_reg->stats[iopar->id].pollinterval = interval;
+}
+
+/* account a get of @iopar that its cached value served */
+static inline void iopar_cache_hit(struct iopar *iopar)
+{
+	++libio_reg->stats[iopar->id].ncached;
+}
+
+/* threads.c */
+extern void libio_publish(int iopar_id);
+extern void libio_apply_posted(void);
+extern void libio_shared_free(struct libio_shared *sh);
+
 extern int libio_trace;
 
 extern void netio_sync(void);
+/* netio state, per registry */
+struct netio;
+extern struct netio *netio_new(void);
+extern void netio_free(struct netio *ctx);
+extern void netio_use(struct netio *ctx);
 extern void longdet_flush(void);
+/* request new gpio lines, write held gpio outputs */
+extern void gpio_flush(void);
+/* collect gpio output writes, until released */
+extern void gpio_hold_outputs(void);
+extern int gpio_release_outputs(void);
+/* evaluate pending expr parameters, returns how many */
+extern int expr_flush(void);
 
 /* raw create function */
 extern struct iopar *create_libiopar(const char *str);
@@ -73,6 +220,8 @@ extern struct iopar *mkmotordir(char *str);
 extern struct iopar *mkmotorpos(char *str);
 extern struct iopar *mkteleruptor(char *str);
 extern struct iopar *mkvirtualteleruptor(char *str);
+extern struct iopar *mkexpr(char *str);
+extern struct iopar *mkgpio(char *str);
 
 extern struct iopar *mknetiolocal(char *name);
 extern struct iopar *mknetiounix(char *uri);
@@ -7,44 +7,32 @@
 #include <unistd.h>
 #include <fcntl.h>
 
-#include "lib/libt.h"
-
 #include "_libio.h"
 
 /* apple light-sensor sysfs output */
 struct applelight {
 	struct iopar iopar;
+	struct attr *attr;
 	char sysfs[2];
 };
 
-static void applelight_read(struct applelight *al, int warn)
+static void applelight_parse(struct applelight *al, const char *buf, int warn)
 {
-	int fd, ret, ivalue;
-	char buf[32];
+	int ivalue;
 
 	/* warn if requested, or param is present */
-	warn = warn ?: al->iopar.state & ST_PRESENT;
+	warn = warn ?: iopar_state(&al->iopar) & ST_PRESENT;
 
-	fd = open(al->sysfs, O_RDONLY);
-	if (fd < 0) {
-		/* avoid alerting too much */
-		if (warn)
-			elog(LOG_ERR, errno, "open %s", al->sysfs);
-		goto fail_open;
-	}
-	ret = read(fd, buf, sizeof(buf)-1);
-	if (ret < 0) {
+	if (!buf) {
 		/* avoid alerting too much */
 		if (warn)
 			elog(LOG_ERR, errno, "read %s", al->sysfs);
 		goto fail_read;
 	}
-	close(fd);
-	buf[ret] = 0;
 
 	ivalue = strtoul(buf+1, NULL, 10);
-	if (ivalue != (int)(al->iopar.value * 255)) {
-		al->iopar.value = ivalue / 255.0;
+	if (ivalue != (int)(iopar_value(&al->iopar) * 255)) {
+		iopar_value(&al->iopar) = ivalue / 255.0;
 		iopar_set_dirty(&al->iopar);
 	}
 	/* mark as present */
@@ -52,39 +40,49 @@ static void applelight_read(struct applelight *al, int warn)
 	return;
 
 fail_read:
-	close(fd);
-fail_open:
 	iopar_clr_present(&al->iopar);
 }
 
+static void applelight_polled(const char *buf, void *data)
+{
+	applelight_parse(data, buf, 0);
+}
+
 static void applelight_timeout(void *data)
 {
-	applelight_read(data, 0);
-	libt_repeat_timeout(1, applelight_timeout, data);
+	struct applelight *al = data;
+
+	/* the reads of a poll group go out together */
+	attr_pread_queue(al->attr, applelight_polled, al);
 }
 
 static void del_applelight(struct iopar *iopar)
 {
 	struct applelight *al = (void *)iopar;
 
-	libt_remove_timeout(applelight_timeout, al);
+	libio_remove_poll(applelight_timeout, al);
 	cleanup_libiopar(&al->iopar);
+	attr_close(al->attr);
 	free(al);
 }
 
+static const struct iopar_ops applelight_ops = {
+	.del = del_applelight,
+};
+
 struct iopar *mkapplelight(char *sysfs)
 {
 	struct applelight *al;
 
 	al = zalloc(sizeof(*al) + strlen(sysfs));
-	al->iopar.del = del_applelight;
-	al->iopar.set = NULL;
+	iopar_init(&al->iopar, &applelight_ops);
 	/* force the first read to mark value as dirty */
-	al->iopar.value = -1;
+	iopar_value(&al->iopar) = -1;
 	strcpy(al->sysfs, sysfs);
+	al->attr = attr_open(al->sysfs, O_RDONLY);
 
 	/* read initial value & schedule next */
-	applelight_read(al, 1);
-	libt_add_timeout(1, applelight_timeout, al);
+	applelight_parse(al, attr_pread(al->attr), 1);
+	libio_add_poll(1, applelight_timeout, al);
 	return &al->iopar;
 }
@@ -0,0 +1,369 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "lib/libe.h"
+#include "_libio.h"
+
+/*
+ * attribute handles keep a (sysfs) file open, and read or write
+ * it from offset 0, so a poll or set costs 1 syscall.
+ * A handle reopens its file when the device behind it went away.
+ */
+struct attr {
+	struct attr *next;
+	int fd;
+	int oflags;
+	/* a regular file, not truncated by pwrite */
+	int regular;
+	char *buf;
+	int bufsize;
+	/* queued read, see attr_pread_queue */
+	char *qbuf;
+	int qbufsize;
+	int queued;
+	/* attr_close waits for the queued read */
+	int closed;
+	void (*qdone)(const char *buf, void *dat);
+	void *qdat;
+	char path[1];
+};
+
+/* handles for attr_read & friends, most recent first, per thread */
+#define ATTR_CACHED	32
+static __thread struct attr *cache;
+/* close the handles of an exiting thread */
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+static int attr_reopen(struct attr *attr)
+{
+	int fd, saved_errno;
+	struct stat st;
+
+	/* open before closing, so a new fd differs from the old one */
+	fd = open(attr->path, attr->oflags | O_CLOEXEC);
+	if ((fd < 0) && (errno == EACCES) &&
+			((attr->oflags & O_ACCMODE) == O_RDWR)) {
+		/* read-only or write-only attribute */
+		fd = open(attr->path, (attr->oflags & ~O_ACCMODE) | O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			fd = open(attr->path, (attr->oflags & ~O_ACCMODE) | O_WRONLY | O_CLOEXEC);
+	}
+	saved_errno = errno;
+	if (attr->fd >= 0)
+		close(attr->fd);
+	attr->fd = fd;
+	if (fd >= 0)
+		attr->regular = !fstat(fd, &st) && S_ISREG(st.st_mode);
+	errno = saved_errno;
+	return fd;
+}
+
+/* the open file is no longer valid, retry with a fresh one */
+static inline int attr_stale(int err)
+{
+	return (err == ENODEV) || (err == ESTALE) || (err == ENXIO);
+}
+
+struct attr *attr_open(const char *path, int oflags)
+{
+	struct attr *attr;
+
+	attr = zalloc(sizeof(*attr) + strlen(path));
+	strcpy(attr->path, path);
+	attr->oflags = oflags;
+	attr->fd = -1;
+	/* failures return on the first access */
+	attr_reopen(attr);
+	return attr;
+}
+
+void attr_close(struct attr *attr)
+{
+	if (!attr)
+		return;
+	if (attr->queued) {
+		/* the kernel may still write qbuf */
+		attr->closed = 1;
+		return;
+	}
+	if (attr->fd >= 0)
+		close(attr->fd);
+	free(attr->buf);
+	free(attr->qbuf);
+	free(attr);
+}
+
+const char *attr_path(const struct attr *attr)
+{
+	return attr->path;
+}
+
+int attr_fd(const struct attr *attr)
+{
+	return attr->fd;
+}
+
+const char *attr_pread(struct attr *attr)
+{
+	int ret;
+
+	if (!attr->buf) {
+		attr->bufsize = 64;
+		attr->buf = malloc(attr->bufsize);
+		if (!attr->buf)
+			elog(LOG_CRIT, errno, "malloc");
+	}
+	if ((attr->fd < 0) && (attr_reopen(attr) < 0))
+		return NULL;
+	for (;;) {
+		ret = pread(attr->fd, attr->buf, attr->bufsize-1, 0);
+		if ((ret < 0) && attr_stale(errno)) {
+			if (attr_reopen(attr) < 0)
+				return NULL;
+			ret = pread(attr->fd, attr->buf, attr->bufsize-1, 0);
+		}
+		if (ret < 0)
+			return NULL;
+		if (ret < attr->bufsize-1)
+			break;
+		/* maybe truncated, read again in a larger buffer */
+		attr->bufsize *= 2;
+		attr->buf = realloc(attr->buf, attr->bufsize);
+		if (!attr->buf)
+			elog(LOG_CRIT, errno, "realloc");
+	}
+	attr->buf[ret] = 0;
+	return attr->buf;
+}
+
+static void attr_queued_done(int ret, void *dat)
+{
+	struct attr *attr = dat;
+	const char *buf;
+
+	attr->queued = 0;
+	if (attr->closed) {
+		attr_close(attr);
+		return;
+	}
+	if ((ret >= 0) && (ret < attr->qbufsize-1)) {
+		attr->qbuf[ret] = 0;
+		buf = attr->qbuf;
+	} else if ((ret >= 0) || attr_stale(-ret))
+		/* maybe truncated, or reopen */
+		buf = attr_pread(attr);
+	else {
+		errno = -ret;
+		buf = NULL;
+	}
+	attr->qdone(buf, attr->qdat);
+}
+
+int attr_pread_queue(struct attr *attr,
+		void (*done)(const char *buf, void *dat), void *dat)
+{
+	if (attr->queued)
+		/* that one will do */
+		return 0;
+	if ((attr->fd < 0) && (attr_reopen(attr) < 0)) {
+		done(NULL, dat);
+		return -1;
+	}
+	if ((attr->qbufsize < attr->bufsize) || !attr->qbuf) {
+		attr->qbufsize = (attr->bufsize > 64) ? attr->bufsize : 64;
+		free(attr->qbuf);
+		attr->qbuf = malloc(attr->qbufsize);
+		if (!attr->qbuf)
+			elog(LOG_CRIT, errno, "malloc");
+	}
+	attr->qdone = done;
+	attr->qdat = dat;
+	attr->queued = 1;
+	return libe_pread(attr->fd, attr->qbuf, attr->qbufsize-1, 0,
+			attr_queued_done, attr);
+}
+
+int attr_pwrite(struct attr *attr, const char *str, int len)
+{
+	int ret;
+
+	if ((attr->fd < 0) && (attr_reopen(attr) < 0))
+		return -1;
+	ret = pwrite(attr->fd, str, len, 0);
+	if ((ret < 0) && attr_stale(errno)) {
+		if (attr_reopen(attr) < 0)
+			return -1;
+		ret = pwrite(attr->fd, str, len, 0);
+	}
+	if ((ret >= 0) && attr->regular && (ftruncate(attr->fd, ret) < 0))
+		return -1;
+	return ret;
+}
+
+int attr_pwritef(struct attr *attr, const char *fmt, ...)
+{
+	char buf[64];
+	va_list va;
+	int len;
+
+	va_start(va, fmt);
+	len = vsnprintf(buf, sizeof(buf), fmt, va);
+	va_end(va);
+	if (len >= sizeof(buf)) {
+		errno = EOVERFLOW;
+		return -1;
+	}
+	return attr_pwrite(attr, buf, len);
+}
+
+static void free_attr_cache(void);
+
+static void free_thread_cache(void *dat)
+{
+	free_attr_cache();
+}
+
+static void init_cache_key(void)
+{
+	if (pthread_key_create(&cache_key, free_thread_cache))
+		elog(LOG_CRIT, 0, "pthread_key_create failed");
+}
+
+/* shared handle for @path, the least recently used is closed */
+static struct attr *attr_cached(const char *path, int oflags)
+{
+	struct attr *attr, **pattr;
+	int n;
+
+	for (pattr = &cache, n = 0; *pattr; pattr = &(*pattr)->next, ++n) {
+		attr = *pattr;
+		if ((attr->oflags == oflags) && !strcmp(attr->path, path)) {
+			/* move to front */
+			*pattr = attr->next;
+			attr->next = cache;
+			cache = attr;
+			return attr;
+		}
+		if ((n >= ATTR_CACHED-1) && !attr->next) {
+			*pattr = NULL;
+			attr_close(attr);
+			break;
+		}
+	}
+	attr = attr_open(path, oflags);
+	if (attr->fd < 0) {
+		/* don't keep absent files */
+		n = errno;
+		attr_close(attr);
+		errno = n;
+		return NULL;
+	}
+	if (!cache) {
+		pthread_once(&cache_once, init_cache_key);
+		pthread_setspecific(cache_key, &cache);
+	}
+	attr->next = cache;
+	cache = attr;
+	return attr;
+}
+
+/* at exit, the key only runs for other threads */
+__attribute__((destructor))
+static void free_attr_cache(void)
+{
+	struct attr *attr;
+
+	while (cache) {
+		attr = cache;
+		cache = attr->next;
+		attr_close(attr);
+	}
+}
+
+/* sysfs (or any other file) iface */
+static const char *vattr_reads(const char *fmt, va_list va)
+{
+	char file[PATH_MAX], *eol;
+	struct attr *attr;
+	const char *str;
+
+	if (vsnprintf(file, sizeof(file), fmt, va) >= sizeof(file)) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	attr = attr_cached(file, O_RDONLY);
+	if (!attr)
+		return NULL;
+	str = attr_pread(attr);
+	if (!str)
+		return NULL;
+	/* only the first line */
+	eol = strchr(str, '\n');
+	if (eol)
+		eol[1] = 0;
+	return str;
+}
+
+const char *attr_reads(const char *fmt, ...)
+{
+	va_list va;
+	const char *result;
+
+	va_start(va, fmt);
+	result = vattr_reads(fmt, va);
+	va_end(va);
+	return result;
+}
+
+/* */
+int attr_read(int default_value, const char *fmt, ...)
+{
+	va_list va;
+	const char *result;
+
+	va_start(va, fmt);
+	result = vattr_reads(fmt, va);
+	va_end(va);
+
+	if (!result) {
+		elog(LOG_WARNING, errno, "open %s r", fmt);
+		return default_value;
+	}
+	return strtol(result, NULL, 0);
+}
+
+int attr_write(int value, const char *fmt, ...)
+{
+	char file[PATH_MAX];
+	struct attr *attr;
+	int ret;
+	va_list va;
+
+	va_start(va, fmt);
+	ret = vsnprintf(file, sizeof(file), fmt, va);
+	va_end(va);
+	if (ret >= sizeof(file)) {
+		elog(LOG_WARNING, ENAMETOOLONG, "open %s w", fmt);
+		return -1;
+	}
+
+	attr = attr_cached(file, O_WRONLY);
+	if (!attr) {
+		elog(LOG_WARNING, errno, "open %s w", file);
+		return -1;
+	}
+	ret = attr_pwritef(attr, "%i\n", value);
+	if (ret < 0)
+		elog(LOG_WARNING, errno, "write %s", file);
+	return ret;
+}
@@ -9,7 +9,6 @@
 #include <fcntl.h>
 
 #include "lib/libt.h"
-
 #include "_libio.h"
 
 /* bat file for input or output */
@@ -17,79 +16,171 @@ struct batpar {
 	struct iopar iopar;
 	int flags;
 	long lastnum, lastdenom;
-	double delay;
+	/* poll interval, adaptive up to maxdelay */
+	double delay, maxdelay;
+	/* read on get only, when the last read is older than ttl */
+	double ttl, readtime;
 
 	char *id;
 	char *numerator;
 	char *denominator;
+	struct attr *numattr, *denomattr;
+	/* queued reads of a poll, and their results */
+	int nqueued, qfailed;
+	long qnum, qdenom;
 	char saved[2];
 };
 
 static const char *const strflags[] = {
 	"delay",
 		#define ID_DELAY	0
+	"adaptive",
+		#define ID_ADAPTIVE	1
+	"ttl",
+		#define ID_TTL		2
 	NULL,
 };
 
-static void batpar_read(struct batpar *bp, int warn)
+/* process the values read, return 1 when they moved */
+static int batpar_update(struct batpar *bp, int ok, long num, long denom)
 {
-	long num, denom;
-	const char *sval;
-
-	/* warn if requested, or param is present */
-	warn |= bp->iopar.state & ST_PRESENT;
+	int moved;
 
-	sval = attr_reads("/sys/class/power_supply/%s/%s",
-			bp->id, bp->numerator);
-	if (!sval)
-		goto fail_read;
-	num = strtol(sval, NULL, 0);
-	sval = attr_reads("/sys/class/power_supply/%s/%s",
-			bp->id, bp->denominator);
-	if (!sval)
+	if (!ok)
 		goto fail_read;
-	denom = strtol(sval, NULL, 0);
-
-	if (!(bp->iopar.state & ST_PRESENT) ||
-			(num != bp->lastnum) || (denom != bp->lastdenom)) {
+	moved = (num != bp->lastnum) || (denom != bp->lastdenom);
+	if (!(iopar_state(&bp->iopar) & ST_PRESENT) || moved) {
 		bp->lastnum = num;
 		bp->lastdenom = denom;
-		bp->iopar.value = num*1.0/denom;
+		iopar_value(&bp->iopar) = num*1.0/denom;
 		iopar_set_dirty(&bp->iopar);
 	}
 	/* mark as present */
 	iopar_set_present(&bp->iopar);
-	return;
+	return moved;
 
 fail_read:
 	iopar_clr_present(&bp->iopar);
+	return 0;
+}
+
+/* read the attributes now, return 1 when the value moved */
+static int batpar_read(struct batpar *bp, int warn)
+{
+	long num, denom;
+	const char *sval;
+
+	bp->readtime = libt_now();
+	sval = attr_pread(bp->numattr);
+	if (!sval)
+		return batpar_update(bp, 0, 0, 0);
+	num = strtol(sval, NULL, 0);
+	sval = attr_pread(bp->denomattr);
+	if (!sval)
+		return batpar_update(bp, 0, 0, 0);
+	denom = strtol(sval, NULL, 0);
+	return batpar_update(bp, 1, num, denom);
+}
+
+static void batpar_timeout(void *data);
+
+/* queued read of numerator or denominator done */
+static void batpar_polled(struct batpar *bp, const char *buf, long *pvalue)
+{
+	int moved;
+
+	if (buf)
+		*pvalue = strtol(buf, NULL, 0);
+	else
+		bp->qfailed = 1;
+	if (--bp->nqueued)
+		return;
+	moved = batpar_update(bp, !bp->qfailed, bp->qnum, bp->qdenom);
+	iopar_polled(&bp->iopar, libio_poll_adapt(batpar_timeout, bp, moved));
+}
+
+static void batpar_num_read(const char *buf, void *data)
+{
+	struct batpar *bp = data;
+
+	batpar_polled(bp, buf, &bp->qnum);
+}
+
+static void batpar_denom_read(const char *buf, void *data)
+{
+	struct batpar *bp = data;
+
+	batpar_polled(bp, buf, &bp->qdenom);
 }
 
 static void batpar_timeout(void *data)
 {
 	struct batpar *bp = data;
 
-	batpar_read(bp, 0);
-	libt_repeat_timeout(bp->delay, batpar_timeout, bp);
+	if (bp->nqueued)
+		/* the previous poll did not complete */
+		return;
+	/* the reads of a poll group go out together */
+	bp->readtime = libt_now();
+	bp->qfailed = 0;
+	bp->nqueued = 2;
+	attr_pread_queue(bp->numattr, batpar_num_read, bp);
+	attr_pread_queue(bp->denomattr, batpar_denom_read, bp);
 }
 
 static void del_batpar(struct iopar *iopar)
 {
 	struct batpar *bp = (void *)iopar;
 
-	libt_remove_timeout(batpar_timeout, bp);
+	libio_remove_poll(batpar_timeout, bp);
 	cleanup_libiopar(&bp->iopar);
+	attr_close(bp->numattr);
+	attr_close(bp->denomattr);
 	free(bp);
 }
 
+static const struct iopar_ops batpar_ops = {
+	.del = del_batpar,
+};
+
+/* read through, when the cached value is older than ttl */
+static void get_batpar_ttl(struct iopar *iopar)
+{
+	struct batpar *bp = (void *)iopar;
+
+	if (libt_now() < bp->readtime + bp->ttl) {
+		iopar_cache_hit(&bp->iopar);
+		return;
+	}
+	batpar_read(bp, 0);
+	iopar_polled(&bp->iopar, 0);
+}
+
+static const struct iopar_ops batpar_ttl_ops = {
+	.del = del_batpar,
+	.jitget = get_batpar_ttl,
+};
+
+static struct attr *open_batattr(const char *id, const char *name)
+{
+	struct attr *attr;
+	char *path;
+
+	asprintf(&path, "/sys/class/power_supply/%s/%s", id, name);
+	attr = attr_open(path, O_RDONLY);
+	free(path);
+	return attr;
+}
+
 struct iopar *mkbatterypar(char *spec)
 {
 	struct batpar *bp;
 	const char *tok;
+	char *endp;
 	int flag;
 
 	bp = zalloc(sizeof(*bp) + strlen(spec));
-	bp->iopar.del = del_batpar;
+	iopar_init(&bp->iopar, &batpar_ops);
 	strcpy(bp->saved, spec);
 	bp->delay = 60;
 
@@ -97,6 +188,7 @@ struct iopar *mkbatterypar(char *spec)
 	bp->numerator = strtok(NULL, ",");
 	bp->denominator = strtok(NULL, ",");
 	if (!bp->id || !bp->numerator || !bp->denominator)
+		elog(LOG_CRIT, 0, "battery: ID,NUMERATOR,DENOMINATOR expected");
 
 	while (1) {
 		tok = mygetsubopt(strtok(NULL, ","));
@@ -109,14 +201,30 @@ struct iopar *mkbatterypar(char *spec)
 		case ID_DELAY:
 			bp->delay = strtod(mygetsuboptvalue() ?: "60", NULL);
 			break;
+		case ID_ADAPTIVE:
+			/* MIN:MAX */
+			tok = mygetsuboptvalue() ?: "10:600";
+			bp->delay = strtod(tok, &endp);
+			bp->maxdelay = (*endp == ':') ? strtod(endp+1, NULL) : 600;
+			break;
+		case ID_TTL:
+			bp->ttl = strtod(mygetsuboptvalue() ?: "60", NULL);
+			break;
 		default:
 			bp->flags |= 1 << flag;
 			break;
 		}
 	}
 
+	bp->numattr = open_batattr(bp->id, bp->numerator);
+	bp->denomattr = open_batattr(bp->id, bp->denominator);
 	/* read initial value & schedule next */
 	batpar_read(bp, 1);
-	libt_add_timeout(bp->delay, batpar_timeout, bp);
+	if (bp->ttl > 0) {
+		/* on demand, instead of polling */
+		iopar_set_ops(&bp->iopar, &batpar_ttl_ops);
+		return &bp->iopar;
+	}
+	libio_add_adaptive_poll(bp->delay, bp->maxdelay, batpar_timeout, bp);
 	return &bp->iopar;
 }
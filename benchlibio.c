@@ -0,0 +1,82 @@
+/*
+ * libio benchmark: cost of 1 libio_wait loop
+ * for an increasing number of mostly idle parameters.
+ * Each loop, 1 parameter changes, and has a notifier.
+ * Then, the cost of get_iopar() while scanning all parameters.
+ *
+ * Build: make benchlibio
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lib/libt.h"
+#include "_libio.h"
+
+#define NLOOPS	20000
+
+static int nnotified;
+
+static void notified(void *dat)
+{
+	++nnotified;
+}
+
+/* a driver detects a change */
+static void changed(void *dat)
+{
+	if (dat)
+		iopar_set_dirty(dat);
+}
+
+static void bench(int nparams)
+{
+	struct libio_registry *reg, *saved;
+	int j, k, *ids;
+	double t0, sum;
+
+	reg = libio_registry_new();
+	saved = libio_use_registry(reg);
+	ids = malloc(sizeof(*ids)*nparams);
+	for (j = 0; j < nparams; ++j) {
+		ids[j] = create_ioparf("netio:bench%i", j);
+		if (ids[j] < 0)
+			elog(LOG_CRIT, 0, "create_iopar failed");
+		iopar_add_notifier(ids[j], notified, NULL);
+	}
+	/* settle initial changes */
+	libt_add_timeout(0, changed, NULL);
+	libio_wait();
+
+	nnotified = 0;
+	t0 = libt_now();
+	for (j = 0; j < NLOOPS; ++j) {
+		libt_add_timeout(0, changed,
+				lookup_iopar(ids[(j * 7919) % nparams]));
+		libio_wait();
+	}
+	printf("%6i params: %8.1lf ns/loop, %.2lf notifications/loop",
+			nparams, (libt_now() - t0) * 1e9 / NLOOPS,
+			(double)nnotified / NLOOPS);
+
+	sum = 0;
+	t0 = libt_now();
+	for (k = 0; k < 1000000; k += nparams) {
+		for (j = 0; j < nparams; ++j)
+			sum += get_iopar(ids[j]);
+	}
+	printf(", %5.1lf ns/get_iopar\n", (libt_now() - t0) * 1e9 / k);
+
+	libio_use_registry(saved);
+	libio_registry_free(reg);
+	free(ids);
+}
+
+int main(int argc, char *argv[])
+{
+	bench(10);
+	bench(100);
+	bench(1000);
+	bench(10000);
+	bench(100000);
+	return 0;
+}
@@ -3,22 +3,102 @@
 #include <string.h>
 #include <errno.h>
 #include <math.h>
+#include <stdint.h>
 
+#include <unistd.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "lib/libe.h"
+#include "lib/libt.h"
 #include "_libio.h"
 
-struct lookup {
-	struct lookup *next;
+/*
+ * consts are kept in 1 flat table: header, files, entries, hash buckets
+ * and strings, with offsets only. That table is built after parsing,
+ * or mmapped from the cache file named by $LIBIO_CONSTCACHE,
+ * which is valid while the parsed files keep their mtime & size.
+ * Once a notifier is added, the directories of the parsed files are
+ * watched with inotify, and a changed file swaps in a new table.
+ */
+#define CONSTS_MAGIC	0x3163696c /* "lic1" */
+/* wait for more changes before reloading, editors write in steps */
+#define RELOAD_DELAY	0.1
+
+struct constfile {
+	int64_t mtime; /* ns */
+	int64_t size; /* -1 when absent */
+	uint32_t path;
+};
+
+struct constent {
+	uint32_t key, value;
+	/* next entry in the same bucket, +1 */
+	uint32_t hnext;
+};
+
+struct consttable {
+	uint32_t magic;
+	uint32_t nfiles, nents, nbuckets;
+	uint32_t size;
+	uint32_t reserved; /* 64bit alignment of files */
+	/* followed by files, entries, buckets (first entry +1), strings */
+};
+
+struct oldtab {
+	struct oldtab *next;
+	const struct consttable *tab;
+	int mapped;
+};
 
-	char *key;
-	char *value;
-	char buf[2];
+struct constnotifier {
+	struct constnotifier *next;
+	void (*fn)(void *dat);
+	void *dat;
+};
+
+struct constwatch {
+	int wd;
+	char *dir;
 };
 
 static struct {
-	struct lookup *first, *last;
-	int level;
+	const struct consttable *tab;
+	int mapped;
 	int loaded;
-} s;
+	unsigned long generation;
+	/* replaced tables, returned strings may still point there */
+	struct oldtab *retired;
+	struct constnotifier *notifiers;
+	/* inotify, -1 when not watching */
+	int infd;
+	struct constwatch *watches;
+	int nwatches, swatches;
+	/* while parsing */
+	struct constfile *files;
+	struct constent *ents;
+	char *strs;
+	int nfiles, sfiles, nents, sents, nstrs, sstrs;
+} s = {
+	.infd = -1,
+};
+
+#define tab_files(t)	((const struct constfile *)((t)+1))
+#define tab_ents(t)	((const struct constent *)(tab_files(t) + (t)->nfiles))
+#define tab_buckets(t)	((const uint32_t *)(tab_ents(t) + (t)->nents))
+#define tab_strs(t)	((const char *)(tab_buckets(t) + (t)->nbuckets))
+
+static uint32_t hash_str(const char *str)
+{
+	uint32_t h = 2166136261u;
+
+	for (; *str; ++str)
+		h = (h ^ (unsigned char)*str) * 16777619u;
+	return h;
+}
 
 static double todouble(const char *value)
 {
@@ -37,6 +117,58 @@ static double todouble(const char *value)
 	return result;
 }
 
+/* parsing */
+static void *grow(void *array, int *psize, int n, int elsize)
+{
+	if (n < *psize)
+		return array;
+	*psize = *psize ? *psize*2 : 64;
+	array = realloc(array, *psize * elsize);
+	if (!array)
+		elog(LOG_CRIT, errno, "realloc");
+	return array;
+}
+
+static uint32_t add_str(const char *str)
+{
+	int len = strlen(str) + 1;
+	uint32_t off;
+
+	while (s.nstrs + len > s.sstrs)
+		s.strs = grow(s.strs, &s.sstrs, s.sstrs, 1);
+	off = s.nstrs;
+	memcpy(s.strs + off, str, len);
+	s.nstrs += len;
+	return off;
+}
+
+/* absolute path of @file, also when absent */
+static char *abs_path(const char *file)
+{
+	char *path, *cwd;
+
+	path = realpath(file, NULL);
+	if (path || (*file == '/'))
+		return path ?: strdup(file);
+	cwd = get_current_dir_name();
+	asprintf(&path, "%s/%s", cwd ?: ".", file);
+	free(cwd);
+	return path;
+}
+
+static void add_file(const char *file, const struct stat *st)
+{
+	char *path;
+
+	s.files = grow(s.files, &s.sfiles, s.nfiles, sizeof(*s.files));
+	path = abs_path(file);
+	s.files[s.nfiles].path = add_str(path);
+	s.files[s.nfiles].mtime = st ? st->st_mtim.tv_sec*1000000000LL + st->st_mtim.tv_nsec : 0;
+	s.files[s.nfiles].size = st ? st->st_size : -1;
+	++s.nfiles;
+	free(path);
+}
+
 /* load consts of 1 named file */
 static void load_consts_file(const char *file)
 {
@@ -44,14 +176,17 @@ static void load_consts_file(const char *file)
 	int ret, linenr = 0;
 	char *line = NULL, *key, *value;
 	size_t linesize = 0;
-	struct lookup *ptr;
+	struct stat st;
 
 	fp = fopen(file, "r");
 	if (!fp) {
 		if (errno != ENOENT)
 			elog(LOG_ERR, errno, "open %s", file);
+		add_file(file, NULL);
 		return;
 	}
+	fstat(fileno(fp), &st);
+	add_file(file, &st);
 	while (!feof(fp)) {
 		ret = getline(&line, &linesize, fp);
 		if (ret <= 0)
@@ -76,57 +211,420 @@ static void load_consts_file(const char *file)
 			continue;
 		}
 		/* create entry */
-		ptr = zalloc(sizeof(*ptr) + ret);
-		strcpy(ptr->buf, key);
-		ptr->key = ptr->buf;
-		ptr->value = ptr->key + strlen(ptr->key) + 1;
-		strcpy(ptr->value, value);
-		/* add in linked list */
-		if (s.last)
-			s.last->next = ptr;
-		s.last = ptr;
-		if (!s.first)
-			s.first = ptr;
+		s.ents = grow(s.ents, &s.sents, s.nents, sizeof(*s.ents));
+		s.ents[s.nents].key = add_str(key);
+		s.ents[s.nents].value = add_str(value);
+		++s.nents;
 
 		if (libio_trace >= 2)
 			fprintf(stderr, "%s: %s\t%s\n", file, key, value);
 	}
+	if (line)
+		free(line);
 	fclose(fp);
 	return;
 }
 
-/* load all system-wide & user definded consts */
-static void load_consts(void)
+static const struct constent *lookup_const(const struct consttable *tab, const char *name)
+{
+	const struct constent *ents = tab_ents(tab);
+	const char *strs = tab_strs(tab);
+	uint32_t j;
+
+	for (j = tab_buckets(tab)[hash_str(name) & (tab->nbuckets-1)]; j; j = ents[j-1].hnext) {
+		if (!strcmp(name, strs + ents[j-1].key))
+			return &ents[j-1];
+	}
+	return NULL;
+}
+
+/* pack the parsed consts into 1 table */
+static struct consttable *build_consttable(void)
+{
+	struct consttable *tab;
+	struct constent *ents;
+	uint32_t *buckets, *pb;
+	int j, nbuckets;
+
+	for (nbuckets = 16; nbuckets < s.nents*2; nbuckets *= 2);
+	tab = zalloc(sizeof(*tab) + s.nfiles*sizeof(*s.files) + s.nents*sizeof(*s.ents)
+			+ nbuckets*sizeof(*buckets) + s.nstrs);
+	tab->magic = CONSTS_MAGIC;
+	tab->nfiles = s.nfiles;
+	tab->nents = s.nents;
+	tab->nbuckets = nbuckets;
+	tab->size = (char *)tab_strs(tab) + s.nstrs - (char *)tab;
+	memcpy((void *)tab_files(tab), s.files, s.nfiles*sizeof(*s.files));
+	ents = memcpy((void *)tab_ents(tab), s.ents, s.nents*sizeof(*s.ents));
+	memcpy((void *)tab_strs(tab), s.strs, s.nstrs);
+	buckets = (uint32_t *)tab_buckets(tab);
+	for (j = 0; j < s.nents; ++j) {
+		/* the first definition wins */
+		if (lookup_const(tab, tab_strs(tab) + ents[j].key))
+			continue;
+		pb = &buckets[hash_str(tab_strs(tab) + ents[j].key) & (nbuckets-1)];
+		ents[j].hnext = *pb;
+		*pb = j+1;
+	}
+	return tab;
+}
+
+/* test if any parsed file changed since @tab was built */
+static int consttable_stale(const struct consttable *tab)
+{
+	const struct constfile *files = tab_files(tab);
+	struct stat st;
+	int j;
+
+	for (j = 0; j < tab->nfiles; ++j) {
+		if (stat(tab_strs(tab) + files[j].path, &st) < 0) {
+			if (files[j].size >= 0)
+				return 1;
+		} else if ((files[j].size != st.st_size) || (files[j].mtime !=
+				st.st_mtim.tv_sec*1000000000LL + st.st_mtim.tv_nsec))
+			return 1;
+	}
+	return 0;
+}
+
+/* cache */
+/* test that every section & offset of @tab lies within @mapsize */
+static int consttable_valid(const struct consttable *tab, size_t mapsize)
+{
+	const struct constfile *files;
+	const struct constent *ents;
+	const uint32_t *buckets;
+	const char *strs;
+	uint64_t hdrsize;
+	uint32_t j, nstrs;
+
+	if ((tab->magic != CONSTS_MAGIC) || (tab->size != mapsize))
+		return 0;
+	/* lookup_const masks the hash */
+	if (!tab->nbuckets || (tab->nbuckets & (tab->nbuckets-1)))
+		return 0;
+	hdrsize = sizeof(*tab) + (uint64_t)tab->nfiles*sizeof(*files) +
+		(uint64_t)tab->nents*sizeof(*ents) +
+		(uint64_t)tab->nbuckets*sizeof(*buckets);
+	/* strings are 0 terminated, the last one too */
+	if (hdrsize >= mapsize)
+		return 0;
+	strs = tab_strs(tab);
+	nstrs = mapsize - hdrsize;
+	if (strs[nstrs-1])
+		return 0;
+	files = tab_files(tab);
+	for (j = 0; j < tab->nfiles; ++j) {
+		if (files[j].path >= nstrs)
+			return 0;
+	}
+	ents = tab_ents(tab);
+	for (j = 0; j < tab->nents; ++j) {
+		if ((ents[j].key >= nstrs) || (ents[j].value >= nstrs))
+			return 0;
+		/* chains run to earlier entries, so they end */
+		if (ents[j].hnext > j)
+			return 0;
+	}
+	buckets = tab_buckets(tab);
+	for (j = 0; j < tab->nbuckets; ++j) {
+		if (buckets[j] > tab->nents)
+			return 0;
+	}
+	return 1;
+}
+
+static const struct consttable *map_cache(const char *cachefile)
+{
+	struct consttable *tab;
+	const struct constfile *files;
+	struct stat st;
+	char *cwdfile;
+	int fd, j;
+	size_t mapsize;
+
+	fd = open(cachefile, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	if ((fstat(fd, &st) < 0) || (st.st_size < sizeof(*tab))) {
+		close(fd);
+		return NULL;
+	}
+	mapsize = st.st_size;
+	tab = mmap(NULL, mapsize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (tab == MAP_FAILED)
+		return NULL;
+	if (!consttable_valid(tab, mapsize)) {
+		elog(LOG_NOTICE, 0, "%s: invalid, parsing consts", cachefile);
+		goto stale;
+	}
+	files = tab_files(tab);
+	/* .libio is relative to the current directory */
+	cwdfile = abs_path(".libio");
+	j = !tab->nfiles || strcmp(cwdfile, tab_strs(tab) + files[0].path);
+	free(cwdfile);
+	if (j || consttable_stale(tab))
+		goto stale;
+	return tab;
+stale:
+	munmap(tab, mapsize);
+	return NULL;
+}
+
+static void write_cache(const char *cachefile, const struct consttable *tab)
+{
+	char *tmp;
+	int fd;
+
+	asprintf(&tmp, "%s.%u", cachefile, getpid());
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		elog(LOG_WARNING, errno, "open %s", tmp);
+		goto done;
+	}
+	if (write(fd, tab, tab->size) != tab->size) {
+		elog(LOG_WARNING, errno, "write %s", tmp);
+		close(fd);
+		unlink(tmp);
+		goto done;
+	}
+	close(fd);
+	/* replace atomically, mapped copies remain valid */
+	if (rename(tmp, cachefile) < 0) {
+		elog(LOG_WARNING, errno, "rename %s", cachefile);
+		unlink(tmp);
+	}
+done:
+	free(tmp);
+}
+
+/* parse all system-wide & user definded consts */
+static struct consttable *parse_consts(void)
 {
+	struct consttable *tab;
+
+	s.nfiles = s.nents = s.nstrs = 0;
 	load_consts_file(".libio");
 	load_consts_file("/etc/libio.conf");
 	fflush(stderr);
+	tab = build_consttable();
+	free(s.files);
+	free(s.ents);
+	free(s.strs);
+	s.files = NULL;
+	s.ents = NULL;
+	s.strs = NULL;
+	s.sfiles = s.sents = s.sstrs = 0;
+	return tab;
+}
+
+static void load_consts(void)
+{
+	const char *cachefile = getenv("LIBIO_CONSTCACHE");
+
 	s.loaded = 1;
+	if (cachefile && (s.tab = map_cache(cachefile))) {
+		s.mapped = 1;
+		return;
+	}
+	s.tab = parse_consts();
+	if (cachefile)
+		write_cache(cachefile, s.tab);
+}
+
+static void free_consttable(const struct consttable *tab, int mapped)
+{
+	if (mapped)
+		munmap((void *)tab, tab->size);
+	else
+		free((void *)tab);
+}
+
+/* live reload */
+static void watch_consts(void)
+{
+	const struct constfile *files = tab_files(s.tab);
+	char *path, *dir;
+	int j, k, wd;
+
+	for (j = 0; j < s.tab->nfiles; ++j) {
+		path = strdup(tab_strs(s.tab) + files[j].path);
+		dir = dirname(path);
+		for (k = 0; k < s.nwatches; ++k) {
+			if (!strcmp(dir, s.watches[k].dir))
+				break;
+		}
+		if (k < s.nwatches)
+			goto next;
+		/* catch new, replaced and removed files too */
+		wd = inotify_add_watch(s.infd, dir, IN_CLOSE_WRITE | IN_MOVED_TO |
+				IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ONLYDIR);
+		if (wd < 0) {
+			elog(LOG_WARNING, errno, "inotify_add_watch %s", dir);
+			goto next;
+		}
+		s.watches = grow(s.watches, &s.swatches, s.nwatches, sizeof(*s.watches));
+		s.watches[s.nwatches].wd = wd;
+		s.watches[s.nwatches].dir = strdup(dir);
+		++s.nwatches;
+next:
+		free(path);
+	}
+}
+
+static void reload_consts(void *dat)
+{
+	const char *cachefile = getenv("LIBIO_CONSTCACHE");
+	struct consttable *tab;
+	struct oldtab *old;
+	struct constnotifier *nt;
+
+	if (!consttable_stale(s.tab))
+		return;
+	tab = parse_consts();
+	old = zalloc(sizeof(*old));
+	old->tab = s.tab;
+	old->mapped = s.mapped;
+	old->next = s.retired;
+	s.retired = old;
+	__atomic_store_n(&s.tab, tab, __ATOMIC_RELEASE);
+	s.mapped = 0;
+	++s.generation;
+	if (cachefile)
+		write_cache(cachefile, s.tab);
+	/* an include may name another directory now */
+	watch_consts();
+	elog(LOG_INFO, 0, "consts reloaded, generation %lu", s.generation);
+	for (nt = s.notifiers; nt; nt = nt->next)
+		nt->fn(nt->dat);
+}
+
+static int is_const_file(const char *dir, const char *name)
+{
+	const struct constfile *files = tab_files(s.tab);
+	const char *path;
+	int j, len = strlen(dir);
+
+	for (j = 0; j < s.tab->nfiles; ++j) {
+		path = tab_strs(s.tab) + files[j].path;
+		if (!strncmp(path, dir, len) && (path[len] == '/') &&
+				!strcmp(path+len+1, name))
+			return 1;
+	}
+	return 0;
+}
+
+static void read_inotify(int fd, void *dat)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	const struct inotify_event *ev;
+	int ret, j, changed = 0;
+
+	for (;;) {
+		ret = read(fd, buf, sizeof(buf));
+		if (ret < 0) {
+			if (errno != EAGAIN)
+				elog(LOG_ERR, errno, "read inotify");
+			break;
+		}
+		for (ev = (void *)buf; (char *)ev < buf+ret;
+				ev = (void *)((char *)(ev+1) + ev->len)) {
+			if (ev->mask & IN_Q_OVERFLOW) {
+				changed = 1;
+				continue;
+			}
+			if (!ev->len)
+				continue;
+			for (j = 0; j < s.nwatches; ++j) {
+				if (s.watches[j].wd == ev->wd)
+					break;
+			}
+			if ((j < s.nwatches) && is_const_file(s.watches[j].dir, ev->name))
+				changed = 1;
+		}
+	}
+	if (changed)
+		libt_add_timeout(RELOAD_DELAY, reload_consts, NULL);
+}
+
+int libio_add_const_notifier(void (*fn)(void *dat), void *dat)
+{
+	struct constnotifier *nt;
+
+	if (!s.loaded)
+		load_consts();
+	if (s.infd < 0) {
+		s.infd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (s.infd < 0) {
+			elog(LOG_ERR, errno, "inotify_init");
+			return -1;
+		}
+		if (libe_add_fd(s.infd, read_inotify, NULL) < 0) {
+			close(s.infd);
+			s.infd = -1;
+			return -1;
+		}
+		watch_consts();
+		/* catch changes since the table was built */
+		if (consttable_stale(s.tab))
+			libt_add_timeout(0, reload_consts, NULL);
+	}
+	nt = zalloc(sizeof(*nt));
+	nt->fn = fn;
+	nt->dat = dat;
+	nt->next = s.notifiers;
+	s.notifiers = nt;
+	return 0;
+}
+
+unsigned long libio_consts_generation(void)
+{
+	return s.generation;
 }
 
 __attribute__((destructor))
 static void free_consts(void)
 {
-	struct lookup *ptr;
+	struct oldtab *old;
+	struct constnotifier *nt;
 
-	while (s.first) {
-		ptr = s.first;
-		s.first = ptr->next;
-		free(ptr);
+	if (s.infd >= 0) {
+		/* the loop is gone by now, only close */
+		close(s.infd);
+		s.infd = -1;
+	}
+	while (s.nwatches)
+		free(s.watches[--s.nwatches].dir);
+	free(s.watches);
+	s.watches = NULL;
+	while (s.notifiers) {
+		nt = s.notifiers;
+		s.notifiers = nt->next;
+		free(nt);
 	}
+	while (s.retired) {
+		old = s.retired;
+		s.retired = old->next;
+		free_consttable(old->tab, old->mapped);
+		free(old);
+	}
+	if (!s.tab)
+		return;
+	free_consttable(s.tab, s.mapped);
+	s.tab = NULL;
 }
 
 const char *libio_strconst(const char *name)
 {
-	struct lookup *ptr;
+	const struct constent *ent;
 
 	if (!s.loaded)
 		load_consts();
 
-	for (ptr = s.first; ptr; ptr = ptr->next) {
-		if (!strcmp(name, ptr->key))
-			return ptr->value;
-	}
+	ent = lookup_const(s.tab, name);
+	if (ent)
+		return tab_strs(s.tab) + ent->value;
 	/* warn, and add fake entry */
 	elog(LOG_NOTICE, 0, "%s '%s' not found", __func__, name);
 	return NULL;
@@ -161,30 +659,23 @@ struct iopar *mkpreset(char *str)
 	return par;
 }
 
-/* iterator */
+/* iterator, in order of definition */
 const char *libio_next_const(const char *name)
 {
-	struct lookup *ptr;
-	static struct lookup *last = NULL;
+	const struct constent *ent;
+	static int last = -1;
 
 	if (!s.loaded)
 		load_consts();
 
-	if (!name) {
-		last = s.first;
-		goto done;
-	} else if (last && !strcmp(name, last->key)) {
-		last = last->next;
-		goto done;
-	}
-
-	/* lookup */
-	for (ptr = s.first; ptr; ptr = ptr->next) {
-		if (!strcmp(name, ptr->key)) {
-			last = ptr->next;
-			break;
-		}
+	if (!name)
+		last = 0;
+	else if ((last >= 0) && (last < s.tab->nents) &&
+			!strcmp(name, tab_strs(s.tab) + tab_ents(s.tab)[last].key))
+		++last;
+	else {
+		ent = lookup_const(s.tab, name);
+		last = ent ? ent - tab_ents(s.tab) + 1 : s.tab->nents;
 	}
-done:
-	return last ? last->key : NULL;
+	return (last < s.tab->nents) ? tab_strs(s.tab) + tab_ents(s.tab)[last].key : NULL;
 }
@@ -193,8 +193,8 @@ static void cpu_timer(void *data)
 			if (cpu->index == cp->index)
 				break;
 		}
-		cp->iopar.value = cpu ? cp->extract(cpu) : NAN;
-		if (!isnan(cp->iopar.value))
+		iopar_value(&cp->iopar) = cpu ? cp->extract(cpu) : NAN;
+		if (!isnan(iopar_value(&cp->iopar)))
 			iopar_set_dirty(&cp->iopar);
 		if (cpu && cpu->present)
 			iopar_set_present(&cp->iopar);
@@ -203,7 +203,7 @@ static void cpu_timer(void *data)
 	}
 
 	/* schedule next */
-	libt_add_timeout(1, cpu_timer, data);
+	libt_add_timeout_prio(1, 0.25, LIBT_PRIO_LOW, cpu_timer, data);
 }
 
 /* CPU parameters */
@@ -226,15 +226,18 @@ static void del_cpupar(struct iopar *iopar)
 	free(cp);
 }
 
+static const struct iopar_ops cpupar_ops = {
+	.del = del_cpupar,
+};
+
 struct iopar *mkcpupar(char *desc)
 {
 	struct cpupar *cp;
 
 	cp = zalloc(sizeof(*cp));
-	cp->iopar.del = del_cpupar;
-	cp->iopar.set = NULL;
+	iopar_init(&cp->iopar, &cpupar_ops);
 	/* force the first read to mark value as dirty */
-	cp->iopar.value = NAN;
+	iopar_value(&cp->iopar) = NAN;
 
 	if (!strncmp(desc, "load", 4)) {
 		cp->extract = extract_cpu_load;
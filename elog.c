@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <signal.h>
+
+#include <pthread.h>
+
+#include "lib/libt.h"
+#include "libio.h"
+
+/*
+ * elog formats into a preallocated ring, a background thread
+ * empties it into syslog, so a blocked syslog never stalls the loop.
+ * Repeats of the last message are counted for a while, not logged.
+ */
+#define LOG_SLOTS	64
+#define LOG_MSGSIZE	256
+/* seconds during which a repeated message is only counted */
+#define LOG_REPEATTIME	10
+
+struct logmsg {
+	int prio;
+	char str[LOG_MSGSIZE];
+};
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int running; /* flusher thread started */
+	int sync; /* log directly, in a forked child */
+	/* ring, head & tail only increment */
+	unsigned int head, tail;
+	unsigned long dropped;
+	/* last message, to suppress repeats */
+	int lastprio;
+	unsigned long repeated;
+	double lasttime;
+	char last[LOG_MSGSIZE];
+	struct logmsg ring[LOG_SLOTS];
+} lg = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+static void push_logmsg(int prio, const char *str)
+{
+	struct logmsg *msg;
+
+	if (lg.head - lg.tail >= LOG_SLOTS) {
+		++lg.dropped;
+		return;
+	}
+	msg = &lg.ring[lg.head++ % LOG_SLOTS];
+	msg->prio = prio;
+	strcpy(msg->str, str);
+}
+
+static void push_repeated(void)
+{
+	char str[64];
+
+	if (!lg.repeated)
+		return;
+	sprintf(str, "last message repeated %lu times", lg.repeated);
+	push_logmsg(lg.lastprio, str);
+	lg.repeated = 0;
+}
+
+/* take the oldest message, with lg.lock held */
+static int pop_logmsg(struct logmsg *msg)
+{
+	if (lg.dropped) {
+		msg->prio = LOG_WARNING;
+		sprintf(msg->str, "%lu log messages dropped", lg.dropped);
+		lg.dropped = 0;
+		return 1;
+	}
+	if (lg.head == lg.tail)
+		return 0;
+	*msg = lg.ring[lg.tail++ % LOG_SLOTS];
+	return 1;
+}
+
+static void *log_flusher(void *dat)
+{
+	struct logmsg msg;
+
+	pthread_mutex_lock(&lg.lock);
+	for (;;) {
+		if (!pop_logmsg(&msg)) {
+			pthread_cond_wait(&lg.cond, &lg.lock);
+			continue;
+		}
+		pthread_mutex_unlock(&lg.lock);
+		syslog(msg.prio, "%s\n", msg.str);
+		pthread_mutex_lock(&lg.lock);
+	}
+	return NULL;
+}
+
+/* empty the ring from this thread, with lg.lock held */
+static void flush_logmsgs(void)
+{
+	struct logmsg msg;
+
+	while (pop_logmsg(&msg))
+		syslog(msg.prio, "%s\n", msg.str);
+}
+
+static void start_flusher(void)
+{
+	pthread_t thread;
+	sigset_t all, saved;
+
+	/* signals are for the signalfd of the loop, not for this thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &saved);
+	if (!pthread_create(&thread, NULL, log_flusher, NULL)) {
+		pthread_detach(thread);
+		lg.running = 1;
+	} else
+		/* stay synchronous */
+		lg.sync = 1;
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+}
+
+static void elog_prefork(void)
+{
+	pthread_mutex_lock(&lg.lock);
+}
+
+static void elog_postfork(void)
+{
+	pthread_mutex_unlock(&lg.lock);
+}
+
+static void elog_postfork_child(void)
+{
+	/* the parent logs what is queued, the child may exec soon */
+	pthread_mutex_init(&lg.lock, NULL);
+	lg.tail = lg.head;
+	lg.dropped = lg.repeated = 0;
+	lg.running = 0;
+	lg.sync = 1;
+}
+
+__attribute__((constructor))
+static void init_elog(void)
+{
+	pthread_atfork(elog_prefork, elog_postfork, elog_postfork_child);
+}
+
+__attribute__((destructor))
+static void exit_elog(void)
+{
+	pthread_mutex_lock(&lg.lock);
+	push_repeated();
+	flush_logmsgs();
+	pthread_mutex_unlock(&lg.lock);
+}
+
+void elog(int prio, int errnum, const char *fmt, ...)
+{
+	char str[LOG_MSGSIZE], errbuf[64];
+	va_list va;
+	int len;
+	double now = libt_now();
+
+	va_start(va, fmt);
+	len = vsnprintf(str, sizeof(str), fmt, va);
+	va_end(va);
+	if (errnum && (len < sizeof(str)))
+		snprintf(str+len, sizeof(str)-len, ": %s",
+				strerror_r(errnum, errbuf, sizeof(errbuf)));
+
+	pthread_mutex_lock(&lg.lock);
+	if ((prio == lg.lastprio) && (now < lg.lasttime + LOG_REPEATTIME) &&
+			!strcmp(str, lg.last)) {
+		++lg.repeated;
+		if ((prio > LOG_CRIT) && !lg.sync) {
+			/* nothing new for the flusher */
+			pthread_mutex_unlock(&lg.lock);
+			return;
+		}
+	} else {
+		push_repeated();
+		push_logmsg(prio, str);
+		lg.lastprio = prio;
+		lg.lasttime = now;
+		strcpy(lg.last, str);
+	}
+
+	if ((prio <= LOG_CRIT) || lg.sync) {
+		push_repeated();
+		flush_logmsgs();
+		pthread_mutex_unlock(&lg.lock);
+		if (prio <= LOG_CRIT)
+			exit(1);
+		return;
+	}
+	if (!lg.running)
+		start_flusher();
+	pthread_cond_signal(&lg.cond);
+	pthread_mutex_unlock(&lg.lock);
+}
@@ -0,0 +1,532 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <math.h>
+
+#include "_libio.h"
+
+/*
+ * expr:EXPRESSION
+ * Operands are numbers, preset names, or any spec within {}.
+ * Operators, from low to high precedence, as in C:
+ *	?:  ||  &&  == !=  < <= > >=  + -  * / %  unary - ! +
+ * The expression compiles to bytecode for a small stack machine.
+ */
+enum {
+	OP_CONST, /* next byte indexes consts */
+	OP_VAR, /* next byte indexes vars */
+	OP_NEG,
+	OP_NOT,
+	OP_OR,
+	OP_AND,
+	OP_EQ,
+	OP_NE,
+	OP_LT,
+	OP_LE,
+	OP_GT,
+	OP_GE,
+	OP_ADD,
+	OP_SUB,
+	OP_MUL,
+	OP_DIV,
+	OP_MOD,
+	OP_SEL,
+	OP_END,
+};
+
+#define MAX_OPERANDS	256
+
+struct exprpar {
+	struct iopar iopar;
+	unsigned char *code;
+	double *consts;
+	int *vars;
+	int nconsts, nvars;
+	int stacksize;
+	/* 1 + the highest level of the expr parameters it uses */
+	int level;
+	/* queued on libio_reg->exprpending */
+	int pending;
+	struct exprpar *nextpending;
+	/* expr parameters that use this one, they're evaluated after it */
+	struct exprpar **users;
+	int nusers;
+	/* operand of that many expr parameters, 0 when created by the user */
+	int refs;
+};
+
+static const struct binop {
+	const char *str;
+	int prec;
+	int op;
+} binops[] = {
+	/* longest first */
+	{ "||", 1, OP_OR, },
+	{ "&&", 2, OP_AND, },
+	{ "==", 3, OP_EQ, },
+	{ "!=", 3, OP_NE, },
+	{ "<=", 4, OP_LE, },
+	{ ">=", 4, OP_GE, },
+	{ "<", 4, OP_LT, },
+	{ ">", 4, OP_GT, },
+	{ "+", 5, OP_ADD, },
+	{ "-", 5, OP_SUB, },
+	{ "*", 6, OP_MUL, },
+	{ "/", 6, OP_DIV, },
+	{ "%", 6, OP_MOD, },
+	{ },
+};
+
+struct compiler {
+	const char *str;
+	const char *spec;
+	struct exprpar *ep;
+	int ncode, scode;
+	int depth;
+};
+
+static const struct iopar_ops expr_ops;
+
+/* evaluation */
+static double expr_run(struct exprpar *ep, int *ppresent)
+{
+	double stack[ep->stacksize], *sp = stack - 1;
+	const unsigned char *pc;
+	int present = 1, id;
+
+	for (pc = ep->code; ; ++pc)
+	switch (*pc) {
+	case OP_CONST:
+		*++sp = ep->consts[*++pc];
+		break;
+	case OP_VAR:
+		id = ep->vars[*++pc];
+		*++sp = get_iopar(id);
+		if (iopar_present(id) <= 0)
+			present = 0;
+		break;
+	case OP_NEG:
+		*sp = -*sp;
+		break;
+	case OP_NOT:
+		*sp = !(*sp >= 0.5);
+		break;
+	case OP_OR:
+		--sp;
+		*sp = (sp[0] >= 0.5) || (sp[1] >= 0.5);
+		break;
+	case OP_AND:
+		--sp;
+		*sp = (sp[0] >= 0.5) && (sp[1] >= 0.5);
+		break;
+	case OP_EQ:
+		--sp;
+		*sp = sp[0] == sp[1];
+		break;
+	case OP_NE:
+		--sp;
+		*sp = sp[0] != sp[1];
+		break;
+	case OP_LT:
+		--sp;
+		*sp = sp[0] < sp[1];
+		break;
+	case OP_LE:
+		--sp;
+		*sp = sp[0] <= sp[1];
+		break;
+	case OP_GT:
+		--sp;
+		*sp = sp[0] > sp[1];
+		break;
+	case OP_GE:
+		--sp;
+		*sp = sp[0] >= sp[1];
+		break;
+	case OP_ADD:
+		--sp;
+		*sp = sp[0] + sp[1];
+		break;
+	case OP_SUB:
+		--sp;
+		*sp = sp[0] - sp[1];
+		break;
+	case OP_MUL:
+		--sp;
+		*sp = sp[0] * sp[1];
+		break;
+	case OP_DIV:
+		--sp;
+		*sp = sp[0] / sp[1];
+		break;
+	case OP_MOD:
+		--sp;
+		*sp = fmod(sp[0], sp[1]);
+		break;
+	case OP_SEL:
+		sp -= 2;
+		*sp = (sp[0] >= 0.5) ? sp[1] : sp[2];
+		break;
+	case OP_END:
+	default:
+		*ppresent = present;
+		return *sp;
+	}
+}
+
+static void queue_expr(struct exprpar *ep)
+{
+	struct exprpar **pep;
+
+	if (ep->pending)
+		return;
+	/* lower levels first, FIFO within a level */
+	for (pep = &libio_reg->exprpending; *pep; pep = &(*pep)->nextpending) {
+		if ((*pep)->level > ep->level)
+			break;
+	}
+	ep->nextpending = *pep;
+	*pep = ep;
+	ep->pending = 1;
+}
+
+static void expr_update(struct exprpar *ep)
+{
+	double saved_value = iopar_value(&ep->iopar), value;
+	int present, j;
+
+	/* the changed inputs provide the origin */
+	libio_reg->origin = 0;
+	value = expr_run(ep, &present);
+	iopar_value(&ep->iopar) = value;
+	if (present)
+		iopar_set_present(&ep->iopar);
+	else
+		iopar_clr_present(&ep->iopar);
+	if ((value == saved_value) || (isnan(value) && isnan(saved_value)))
+		return;
+	iopar_set_dirty(&ep->iopar);
+	for (j = 0; j < ep->nusers; ++j)
+		queue_expr(ep->users[j]);
+}
+
+static void expr_input_changed(void *dat)
+{
+	queue_expr(dat);
+}
+
+int expr_flush(void)
+{
+	struct exprpar *ep;
+	int n;
+
+	for (n = 0; libio_reg->exprpending; ++n) {
+		ep = libio_reg->exprpending;
+		libio_reg->exprpending = ep->nextpending;
+		ep->pending = 0;
+		expr_update(ep);
+	}
+	return n;
+}
+
+/* compiler */
+static void emit(struct compiler *c, int op, int arg)
+{
+	if (c->ncode + 2 > c->scode) {
+		c->scode = c->scode ? c->scode*2 : 32;
+		c->ep->code = realloc(c->ep->code, c->scode);
+		if (!c->ep->code)
+			elog(LOG_CRIT, errno, "realloc");
+	}
+	c->ep->code[c->ncode++] = op;
+	if ((op == OP_CONST) || (op == OP_VAR)) {
+		c->ep->code[c->ncode++] = arg;
+		++c->depth;
+	} else if (op == OP_SEL)
+		c->depth -= 2;
+	else if ((op >= OP_OR) && (op <= OP_MOD))
+		--c->depth;
+	if (c->depth > c->ep->stacksize)
+		c->ep->stacksize = c->depth;
+}
+
+static int add_const(struct compiler *c, double value)
+{
+	struct exprpar *ep = c->ep;
+
+	if (ep->nconsts >= MAX_OPERANDS) {
+		elog(LOG_NOTICE, 0, "expr %s: too many constants", c->spec);
+		return -1;
+	}
+	ep->consts = realloc(ep->consts, sizeof(*ep->consts)*(ep->nconsts+1));
+	if (!ep->consts)
+		elog(LOG_CRIT, errno, "realloc");
+	ep->consts[ep->nconsts] = value;
+	emit(c, OP_CONST, ep->nconsts++);
+	return 0;
+}
+
+/* an expr operand of another expr parameter, with the same spec */
+static struct exprpar *find_operand(const char *spec)
+{
+	struct iopar *iopar;
+	int j;
+
+	for (j = 0; j < libio_reg->tablesize; ++j) {
+		iopar = libio_reg->table[j];
+		if (iopar && (iopar->ops == &expr_ops) &&
+				((struct exprpar *)iopar)->refs &&
+				iopar->name && !strcmp(iopar->name, spec))
+			return (struct exprpar *)iopar;
+	}
+	return NULL;
+}
+
+static int add_var(struct compiler *c, const char *spec)
+{
+	struct exprpar *ep = c->ep, *in;
+	struct iopar *iopar;
+	int id;
+
+	if (ep->nvars >= MAX_OPERANDS) {
+		elog(LOG_NOTICE, 0, "expr %s: too many parameters", c->spec);
+		return -1;
+	}
+	/* equal subexpressions share 1 parameter */
+	in = find_operand(spec);
+	if (in) {
+		id = in->iopar.id;
+		++in->refs;
+	} else {
+		id = create_iopar(spec);
+		if (id < 0)
+			return -1;
+		iopar = lookup_iopar(id);
+		if (iopar->ops == &expr_ops)
+			((struct exprpar *)iopar)->refs = 1;
+	}
+	ep->vars = realloc(ep->vars, sizeof(*ep->vars)*(ep->nvars+1));
+	if (!ep->vars)
+		elog(LOG_CRIT, errno, "realloc");
+	ep->vars[ep->nvars] = id;
+	emit(c, OP_VAR, ep->nvars++);
+
+	iopar = lookup_iopar(id);
+	if (iopar->ops == &expr_ops) {
+		/* propagate directly, in level order */
+		in = (struct exprpar *)iopar;
+		in->users = realloc(in->users, sizeof(*in->users)*(in->nusers+1));
+		if (!in->users)
+			elog(LOG_CRIT, errno, "realloc");
+		in->users[in->nusers++] = ep;
+		if (in->level >= ep->level)
+			ep->level = in->level + 1;
+	} else if (iopar_add_notifier(id, expr_input_changed, ep) < 0)
+		return -1;
+	return 0;
+}
+
+static void skip_spaces(struct compiler *c)
+{
+	while (isspace(*c->str))
+		++c->str;
+}
+
+static int parse_ternary(struct compiler *c);
+
+static int parse_primary(struct compiler *c)
+{
+	const char *end;
+	char *endp;
+	int depth;
+
+	skip_spaces(c);
+	if (*c->str == '(') {
+		++c->str;
+		if (parse_ternary(c) < 0)
+			return -1;
+		skip_spaces(c);
+		if (*c->str != ')')
+			goto syntax;
+		++c->str;
+		return 0;
+	} else if (*c->str == '{') {
+		/* nested {} belong to the spec */
+		for (end = ++c->str, depth = 1; *end; ++end) {
+			if (*end == '{')
+				++depth;
+			else if ((*end == '}') && !--depth)
+				break;
+		}
+		if (!*end)
+			goto syntax;
+		if (add_var(c, strndupa(c->str, end - c->str)) < 0)
+			return -1;
+		c->str = end+1;
+		return 0;
+	} else if (isalpha(*c->str) || (*c->str == '_')) {
+		for (end = c->str; isalnum(*end) || (*end == '_'); ++end);
+		if (add_var(c, strndupa(c->str, end - c->str)) < 0)
+			return -1;
+		c->str = end;
+		return 0;
+	} else if (isdigit(*c->str) || (*c->str == '.')) {
+		double value = strtod(c->str, &endp);
+
+		c->str = endp;
+		return add_const(c, value);
+	}
+syntax:
+	elog(LOG_NOTICE, 0, "expr %s: syntax error at '%s'", c->spec, c->str);
+	return -1;
+}
+
+static int parse_unary(struct compiler *c)
+{
+	skip_spaces(c);
+	switch (*c->str) {
+	case '-':
+		++c->str;
+		if (parse_unary(c) < 0)
+			return -1;
+		emit(c, OP_NEG, 0);
+		return 0;
+	case '!':
+		++c->str;
+		if (parse_unary(c) < 0)
+			return -1;
+		emit(c, OP_NOT, 0);
+		return 0;
+	case '+':
+		++c->str;
+		return parse_unary(c);
+	default:
+		return parse_primary(c);
+	}
+}
+
+static int parse_binary(struct compiler *c, int minprec)
+{
+	const struct binop *op;
+
+	if (parse_unary(c) < 0)
+		return -1;
+	for (;;) {
+		skip_spaces(c);
+		for (op = binops; op->str; ++op) {
+			if (!strncmp(c->str, op->str, strlen(op->str)))
+				break;
+		}
+		if (!op->str || (op->prec < minprec))
+			return 0;
+		c->str += strlen(op->str);
+		/* left associative */
+		if (parse_binary(c, op->prec+1) < 0)
+			return -1;
+		emit(c, op->op, 0);
+	}
+}
+
+static int parse_ternary(struct compiler *c)
+{
+	if (parse_binary(c, 1) < 0)
+		return -1;
+	skip_spaces(c);
+	if (*c->str != '?')
+		return 0;
+	++c->str;
+	if (parse_ternary(c) < 0)
+		return -1;
+	skip_spaces(c);
+	if (*c->str != ':') {
+		elog(LOG_NOTICE, 0, "expr %s: missing ':' at '%s'", c->spec, c->str);
+		return -1;
+	}
+	++c->str;
+	if (parse_ternary(c) < 0)
+		return -1;
+	emit(c, OP_SEL, 0);
+	return 0;
+}
+
+/* iopar */
+static void release_expr(struct exprpar *ep)
+{
+	struct iopar *iopar;
+	struct exprpar *in, **pep;
+	int j, k;
+
+	if (ep->pending) {
+		for (pep = &libio_reg->exprpending; *pep != ep; pep = &(*pep)->nextpending);
+		*pep = ep->nextpending;
+	}
+	for (j = 0; j < ep->nvars; ++j) {
+		iopar = lookup_iopar(ep->vars[j]);
+		if (iopar && (iopar->ops == &expr_ops)) {
+			in = (struct exprpar *)iopar;
+			for (k = 0; k < in->nusers; ++k) {
+				if (in->users[k] == ep) {
+					in->users[k] = in->users[--in->nusers];
+					break;
+				}
+			}
+			/* still an operand elsewhere */
+			if (--in->refs > 0)
+				continue;
+		}
+		destroy_iopar(ep->vars[j]);
+	}
+	if (ep->users)
+		free(ep->users);
+	if (ep->vars)
+		free(ep->vars);
+	if (ep->consts)
+		free(ep->consts);
+	if (ep->code)
+		free(ep->code);
+}
+
+static void del_expr(struct iopar *iopar)
+{
+	struct exprpar *ep = (struct exprpar *)iopar;
+
+	release_expr(ep);
+	cleanup_libiopar(&ep->iopar);
+	free(ep);
+}
+
+static const struct iopar_ops expr_ops = {
+	.del = del_expr,
+};
+
+struct iopar *mkexpr(char *str)
+{
+	struct exprpar *ep;
+	struct compiler c = {
+		.str = str,
+		.spec = str,
+	};
+
+	ep = zalloc(sizeof(*ep));
+	iopar_init(&ep->iopar, &expr_ops);
+	c.ep = ep;
+	if (parse_ternary(&c) < 0)
+		goto fail;
+	skip_spaces(&c);
+	if (*c.str) {
+		elog(LOG_NOTICE, 0, "expr %s: trailing '%s'", str, c.str);
+		goto fail;
+	}
+	emit(&c, OP_END, 0);
+	/* initial value */
+	iopar_value(&ep->iopar) = NAN;
+	expr_update(ep);
+	return &ep->iopar;
+
+fail:
+	release_expr(ep);
+	free(ep);
+	return NULL;
+}
@@ -0,0 +1,605 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+#include "lib/libt.h"
+#include "lib/libe.h"
+#include "_libio.h"
+
+/*
+ * gpio lines via the gpiochip character device (uAPI v2)
+ * New lines are collected per chip, and requested together
+ * on first use, so 1 request fd serves up to 64 lines.
+ * Inputs follow the edge events of that fd, with the kernel's
+ * timestamp and debounce. Outputs are written with 1 ioctl per set,
+ * or per request for all outputs set with set_iopars.
+ * Chips & requests belong to the registry of their lines.
+ */
+static const char *const strflags[] = {
+	"out",
+		#define ID_OUT		0
+	"low",
+		#define ID_LOW		1
+	"debounce",
+		#define ID_DEBOUNCE	2
+	"pullup",
+		#define ID_PULLUP	3
+	"pulldown",
+		#define ID_PULLDOWN	4
+	"opendrain",
+		#define ID_OPENDRAIN	5
+	"opensource",
+		#define ID_OPENSOURCE	6
+	NULL,
+};
+
+struct gpiochip {
+	struct gpiochip *next;
+	int fd;
+	/* request that collects new lines */
+	struct gpioreq *collect;
+	char file[2];
+};
+
+struct gpioreq {
+	struct gpioreq *next;
+	struct gpiochip *chip;
+	/* -1 until requested */
+	int fd;
+	int failed;
+	int nlines;
+	/* outputs set, but not yet written */
+	uint64_t outmask, outbits;
+	struct gpio_v2_line_request lr;
+	struct gpioline *lines[GPIO_V2_LINES_MAX];
+};
+
+struct gpioline {
+	struct iopar iopar;
+	struct gpioreq *req;
+	/* index in req */
+	int idx;
+	uint64_t flags;
+	double debounce;
+	/* origin of the last event */
+	double origin;
+};
+
+static inline int is_output(const struct gpioline *line)
+{
+	return !!(line->flags & GPIO_V2_LINE_FLAG_OUTPUT);
+}
+
+/* chips */
+static struct gpiochip *lookup_gpiochip(const char *spec)
+{
+	struct gpiochip *chip;
+	char *file = NULL, *endp;
+	int num;
+
+	if (!strchr(spec, '/')) {
+		num = strtoul(spec, &endp, 10);
+		if (!*endp)
+			asprintf(&file, "/dev/gpiochip%u", num);
+		else
+			asprintf(&file, "/dev/%s", spec);
+		spec = file;
+	}
+	for (chip = libio_reg->gpiochips; chip; chip = chip->next) {
+		if (!strcmp(chip->file, spec))
+			goto found;
+	}
+	chip = zalloc(sizeof(*chip) + strlen(spec));
+	strcpy(chip->file, spec);
+	chip->fd = open(chip->file, O_RDWR | O_CLOEXEC);
+	if (chip->fd < 0) {
+		elog(LOG_WARNING, errno, "open %s", chip->file);
+		free(chip);
+		chip = NULL;
+		goto found;
+	}
+	chip->next = libio_reg->gpiochips;
+	libio_reg->gpiochips = chip;
+found:
+	if (file)
+		free(file);
+	return chip;
+}
+
+/* close @chip when none of the requests use it */
+static void free_gpiochip(struct gpiochip *chip)
+{
+	struct gpiochip **pchip;
+	struct gpioreq *req;
+
+	for (req = libio_reg->gpioreqs; req; req = req->next) {
+		if (req->chip == chip)
+			return;
+	}
+
+	for (pchip = &libio_reg->gpiochips; *pchip; pchip = &(*pchip)->next) {
+		if (*pchip == chip) {
+			*pchip = chip->next;
+			break;
+		}
+	}
+	close(chip->fd);
+	free(chip);
+}
+
+/* line offset of @name, which is a number or a line name */
+static int gpio_line_offset(struct gpiochip *chip, const char *name)
+{
+	struct gpiochip_info info;
+	struct gpio_v2_line_info li;
+	char *endp;
+	int offset;
+
+	offset = strtoul(name, &endp, 0);
+	if ((endp > name) && !*endp)
+		return offset;
+	if (ioctl(chip->fd, GPIO_GET_CHIPINFO_IOCTL, &info) < 0) {
+		elog(LOG_WARNING, errno, "%s: chipinfo", chip->file);
+		return -1;
+	}
+	for (offset = 0; offset < info.lines; ++offset) {
+		memset(&li, 0, sizeof(li));
+		li.offset = offset;
+		if (ioctl(chip->fd, GPIO_V2_GET_LINEINFO_IOCTL, &li) < 0)
+			continue;
+		if (!strcmp(li.name, name))
+			return offset;
+	}
+	elog(LOG_WARNING, 0, "%s: no line %s", chip->file, name);
+	return -1;
+}
+
+/* who holds line @offset of @chip, NULL when free */
+static const char *gpio_line_user(struct gpiochip *chip, int offset)
+{
+	struct gpioreq *req;
+	int j;
+
+	for (req = libio_reg->gpioreqs; req; req = req->next) {
+		if (req->chip != chip)
+			continue;
+		for (j = 0; j < req->nlines; ++j) {
+			if (req->lr.offsets[j] != offset)
+				continue;
+			/* a removed line remains requested with the others */
+			if (!req->lines[j])
+				return "a removed line";
+			return req->lines[j]->iopar.name ?: "?";
+		}
+	}
+	return NULL;
+}
+
+/* config attributes */
+static int find_cfg_attr(const struct gpio_v2_line_config *cfg,
+		const struct gpio_v2_line_attribute *attr)
+{
+	int j;
+
+	for (j = 0; j < cfg->num_attrs; ++j) {
+		if (cfg->attrs[j].attr.id != attr->id)
+			continue;
+		/* only 1 attribute carries all output values */
+		if ((attr->id == GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES) ||
+				!memcmp(&cfg->attrs[j].attr, attr, sizeof(*attr)))
+			return j;
+	}
+	return -1;
+}
+
+static void add_cfg_attr(struct gpio_v2_line_config *cfg,
+		const struct gpio_v2_line_attribute *attr, int idx)
+{
+	int j;
+
+	j = find_cfg_attr(cfg, attr);
+	if (j < 0) {
+		j = cfg->num_attrs++;
+		cfg->attrs[j].attr = *attr;
+	}
+	cfg->attrs[j].mask |= 1ULL << idx;
+}
+
+/* attributes that @line needs, apart from the default flags */
+static int line_attrs(const struct gpioline *line, uint64_t dfltflags,
+		struct gpio_v2_line_attribute *attrs)
+{
+	int n = 0;
+
+	if (line->flags != dfltflags) {
+		attrs[n].id = GPIO_V2_LINE_ATTR_ID_FLAGS;
+		attrs[n++].flags = line->flags;
+	}
+	if (line->debounce > 0) {
+		attrs[n].id = GPIO_V2_LINE_ATTR_ID_DEBOUNCE;
+		attrs[n++].debounce_period_us = line->debounce * 1e6;
+	}
+	if (is_output(line))
+		attrs[n++].id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+	return n;
+}
+
+/* add @line to the collecting request of @chip, start a new one when full */
+static void gpioreq_add_line(struct gpiochip *chip, struct gpioline *line, int offset)
+{
+	struct gpioreq *req = chip->collect;
+	struct gpio_v2_line_attribute attrs[3] = {};
+	int j, n, nnew;
+
+	if (req) {
+		n = line_attrs(line, req->lr.config.flags, attrs);
+		for (j = nnew = 0; j < n; ++j)
+			nnew += find_cfg_attr(&req->lr.config, &attrs[j]) < 0;
+		if ((req->nlines >= GPIO_V2_LINES_MAX) ||
+				(req->lr.config.num_attrs + nnew > GPIO_V2_LINE_NUM_ATTRS_MAX))
+			req = NULL;
+	}
+	if (!req) {
+		req = zalloc(sizeof(*req));
+		req->chip = chip;
+		req->fd = -1;
+		strcpy(req->lr.consumer, "libio");
+		/* the first line's flags are the default */
+		req->lr.config.flags = line->flags;
+		req->next = libio_reg->gpioreqs;
+		libio_reg->gpioreqs = req;
+		chip->collect = req;
+		memset(attrs, 0, sizeof(attrs));
+	}
+	n = line_attrs(line, req->lr.config.flags, attrs);
+	line->req = req;
+	line->idx = req->nlines++;
+	req->lines[line->idx] = line;
+	req->lr.offsets[line->idx] = offset;
+	req->lr.num_lines = req->nlines;
+	for (j = 0; j < n; ++j)
+		add_cfg_attr(&req->lr.config, &attrs[j], line->idx);
+}
+
+/* events */
+static void gpioreq_read_values(struct gpioreq *req)
+{
+	struct gpio_v2_line_values lv = {};
+	struct gpioline *line;
+	int j, value;
+
+	for (j = 0; j < req->nlines; ++j) {
+		if (req->lines[j] && !is_output(req->lines[j]))
+			lv.mask |= 1ULL << j;
+	}
+	if (!lv.mask)
+		return;
+	if (ioctl(req->fd, GPIO_V2_LINE_GET_VALUES_IOCTL, &lv) < 0) {
+		elog(LOG_WARNING, errno, "%s: get values", req->chip->file);
+		return;
+	}
+	for (j = 0; j < req->nlines; ++j) {
+		line = req->lines[j];
+		if (!line || !(lv.mask & (1ULL << j)))
+			continue;
+		value = (lv.bits >> j) & 1;
+		if (!(iopar_state(&line->iopar) & ST_PRESENT) ||
+				(iopar_value(&line->iopar) != value)) {
+			iopar_value(&line->iopar) = value;
+			iopar_set_dirty(&line->iopar);
+		}
+		iopar_set_present(&line->iopar);
+	}
+}
+
+static void read_gpioreq(int fd, void *dat)
+{
+	struct gpioreq *req = dat;
+	struct gpio_v2_line_event evs[16];
+	struct gpioline *line;
+	int ret, j, k;
+
+	for (;;) {
+		ret = read(fd, evs, sizeof(evs));
+		if (ret < 0) {
+			if (errno != EAGAIN)
+				elog(LOG_ERR, errno, "read %s", req->chip->file);
+			break;
+		}
+		for (j = 0; j < ret/sizeof(evs[0]); ++j) {
+			for (k = 0; k < req->nlines; ++k) {
+				if (req->lr.offsets[k] == evs[j].offset)
+					break;
+			}
+			line = (k < req->nlines) ? req->lines[k] : NULL;
+			if (!line)
+				continue;
+			iopar_value(&line->iopar) =
+				(evs[j].id == GPIO_V2_LINE_EVENT_RISING_EDGE) ? 1 : 0;
+			/* CLOCK_MONOTONIC, the timebase of libt_now() */
+			line->origin = evs[j].timestamp_ns * 1e-9;
+			iopar_set_dirty(&line->iopar);
+			iopar_set_origin(&line->iopar, line->origin);
+		}
+		if (ret < sizeof(evs))
+			break;
+	}
+}
+
+static int gpioreq_request(struct gpioreq *req)
+{
+	struct gpio_v2_line_config *cfg = &req->lr.config;
+	struct gpioline *line;
+	int j, k, edges = 0;
+
+	if (req->chip->collect == req)
+		/* new lines go in a new request */
+		req->chip->collect = NULL;
+	/* initial output values */
+	for (k = 0; k < cfg->num_attrs; ++k) {
+		if (cfg->attrs[k].attr.id == GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES)
+			break;
+	}
+	for (j = 0; j < req->nlines; ++j) {
+		line = req->lines[j];
+		if (!line)
+			continue;
+		if (is_output(line) && (k < cfg->num_attrs) &&
+				(iopar_value(&line->iopar) >= 0.5))
+			cfg->attrs[k].attr.values |= 1ULL << j;
+		edges |= !!(line->flags & GPIO_V2_LINE_FLAG_EDGE_RISING);
+	}
+	if (ioctl(req->chip->fd, GPIO_V2_GET_LINE_IOCTL, &req->lr) < 0) {
+		elog(LOG_WARNING, errno, "%s: request %u lines",
+				req->chip->file, req->nlines);
+		/* don't retry on each iteration */
+		req->failed = 1;
+		errno = ENODEV;
+		return -1;
+	}
+	req->fd = req->lr.fd;
+	fcntl(req->fd, F_SETFL, fcntl(req->fd, F_GETFL) | O_NONBLOCK);
+	req->outmask = 0;
+	for (j = 0; j < req->nlines; ++j) {
+		line = req->lines[j];
+		if (line && is_output(line))
+			iopar_set_present(&line->iopar);
+	}
+	if (edges) {
+		libe_add_fd(req->fd, read_gpioreq, req);
+		libe_set_prio(req->fd, LIBE_PRIO_HIGH);
+	}
+	gpioreq_read_values(req);
+	return 0;
+}
+
+static int gpioreq_write_outputs(struct gpioreq *req)
+{
+	struct gpio_v2_line_values lv = {
+		.bits = req->outbits,
+		.mask = req->outmask,
+	};
+
+	req->outmask = req->outbits = 0;
+	if (ioctl(req->fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &lv) < 0) {
+		elog(LOG_WARNING, errno, "%s: set values", req->chip->file);
+		return -1;
+	}
+	return 0;
+}
+
+/* request the collected lines, and write the held outputs */
+static int gpio_sync(void)
+{
+	struct gpioreq *req;
+	int ret = 0;
+
+	for (req = libio_reg->gpioreqs; req; req = req->next) {
+		if (req->failed)
+			continue;
+		if (req->fd < 0) {
+			if (gpioreq_request(req) < 0)
+				ret = -1;
+		} else if (req->outmask && (gpioreq_write_outputs(req) < 0))
+			ret = -1;
+	}
+	return ret;
+}
+
+void gpio_hold_outputs(void)
+{
+	++libio_reg->gpioheld;
+}
+
+int gpio_release_outputs(void)
+{
+	if (--libio_reg->gpioheld)
+		return 0;
+	return gpio_sync();
+}
+
+void gpio_flush(void)
+{
+	if (!libio_reg->gpioheld)
+		gpio_sync();
+}
+
+/* iopar */
+static int set_gpio(struct iopar *iopar, double value)
+{
+	struct gpioline *line = (void *)iopar;
+	struct gpioreq *req = line->req;
+	uint64_t bit = 1ULL << line->idx;
+
+	if (!is_output(line)) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* NAN may be passed to release control */
+	if (isnan(value))
+		value = 0;
+	iopar_value(&line->iopar) = (value >= 0.5) ? 1 : 0;
+	if (req->failed) {
+		errno = ENODEV;
+		return -1;
+	}
+	if (req->fd < 0)
+		/* the request sets the initial value */
+		return libio_reg->gpioheld ? 0 : gpioreq_request(req);
+	req->outmask |= bit;
+	if (value >= 0.5)
+		req->outbits |= bit;
+	else
+		req->outbits &= ~bit;
+	if (libio_reg->gpioheld)
+		return 0;
+	return gpioreq_write_outputs(req);
+}
+
+static void get_gpio(struct iopar *iopar)
+{
+	struct gpioline *line = (void *)iopar;
+
+	if ((line->req->fd < 0) && !line->req->failed)
+		gpioreq_request(line->req);
+}
+
+static void del_gpio(struct iopar *iopar)
+{
+	struct gpioline *line = (void *)iopar;
+	struct gpioreq *req = line->req, **preq;
+	struct gpiochip *chip = req->chip;
+	int j;
+
+	/* the line remains requested until its request is empty */
+	req->lines[line->idx] = NULL;
+	for (j = 0; j < req->nlines; ++j) {
+		if (req->lines[j])
+			break;
+	}
+	if (j >= req->nlines) {
+		for (preq = &libio_reg->gpioreqs; *preq; preq = &(*preq)->next) {
+			if (*preq == req) {
+				*preq = req->next;
+				break;
+			}
+		}
+		if (chip->collect == req)
+			chip->collect = NULL;
+		if (req->fd >= 0) {
+			libe_remove_fd(req->fd);
+			close(req->fd);
+		}
+		free(req);
+		free_gpiochip(chip);
+	}
+	cleanup_libiopar(&line->iopar);
+	free(line);
+}
+
+static const struct iopar_ops gpio_ops = {
+	.del = del_gpio,
+	.set = set_gpio,
+	.jitget = get_gpio,
+};
+
+struct iopar *mkgpio(char *str)
+{
+	struct gpioline *line;
+	struct gpiochip *chip;
+	const char *tok, *user;
+	int flag, offset;
+
+	chip = lookup_gpiochip(strtok(str, ":;,") ?: "0");
+	if (!chip)
+		return NULL;
+	offset = gpio_line_offset(chip, strtok(NULL, ":;,") ?: "0");
+	if (offset < 0)
+		goto fail_chip;
+
+	line = zalloc(sizeof(*line));
+	line->flags = GPIO_V2_LINE_FLAG_INPUT |
+		GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING;
+	while (1) {
+		tok = mygetsubopt(strtok(NULL, ","));
+		if (!tok)
+			break;
+		flag = strlookup(tok, strflags);
+		switch (flag) {
+		case ID_OUT:
+			line->flags &= ~(GPIO_V2_LINE_FLAG_INPUT |
+				GPIO_V2_LINE_FLAG_EDGE_RISING | GPIO_V2_LINE_FLAG_EDGE_FALLING);
+			line->flags |= GPIO_V2_LINE_FLAG_OUTPUT;
+			break;
+		case ID_LOW:
+			line->flags |= GPIO_V2_LINE_FLAG_ACTIVE_LOW;
+			break;
+		case ID_DEBOUNCE:
+			tok = mygetsuboptvalue();
+			line->debounce = tok ? strtod(tok, NULL) : libio_const("debouncetime");
+			if (isnan(line->debounce))
+				line->debounce = 0.002;
+			break;
+		case ID_PULLUP:
+			line->flags |= GPIO_V2_LINE_FLAG_BIAS_PULL_UP;
+			break;
+		case ID_PULLDOWN:
+			line->flags |= GPIO_V2_LINE_FLAG_BIAS_PULL_DOWN;
+			break;
+		case ID_OPENDRAIN:
+			line->flags |= GPIO_V2_LINE_FLAG_OPEN_DRAIN;
+			break;
+		case ID_OPENSOURCE:
+			line->flags |= GPIO_V2_LINE_FLAG_OPEN_SOURCE;
+			break;
+		default:
+			elog(LOG_CRIT, 0, "flag %s unknown", tok);
+			break;
+		}
+	}
+	/* the kernel refuses the whole request for 1 bad line */
+	if (is_output(line) && (line->debounce > 0)) {
+		elog(LOG_WARNING, 0, "%s:%i: debounce on an output", chip->file, offset);
+		goto fail;
+	}
+	if (!is_output(line) && (line->flags & (GPIO_V2_LINE_FLAG_OPEN_DRAIN |
+					GPIO_V2_LINE_FLAG_OPEN_SOURCE))) {
+		elog(LOG_WARNING, 0, "%s:%i: opendrain/opensource on an input",
+				chip->file, offset);
+		goto fail;
+	}
+	if ((line->flags & GPIO_V2_LINE_FLAG_OPEN_DRAIN) &&
+			(line->flags & GPIO_V2_LINE_FLAG_OPEN_SOURCE)) {
+		elog(LOG_WARNING, 0, "%s:%i: opendrain and opensource", chip->file, offset);
+		goto fail;
+	}
+	if ((line->flags & GPIO_V2_LINE_FLAG_BIAS_PULL_UP) &&
+			(line->flags & GPIO_V2_LINE_FLAG_BIAS_PULL_DOWN)) {
+		elog(LOG_WARNING, 0, "%s:%i: pullup and pulldown", chip->file, offset);
+		goto fail;
+	}
+	/* by another spec, or by name and number */
+	user = gpio_line_user(chip, offset);
+	if (user) {
+		elog(LOG_WARNING, 0, "%s:%i: in use by %s", chip->file, offset, user);
+		goto fail;
+	}
+
+	iopar_init(&line->iopar, &gpio_ops);
+	gpioreq_add_line(chip, line, offset);
+	return &line->iopar;
+
+fail:
+	free(line);
+fail_chip:
+	free_gpiochip(chip);
+	return NULL;
+}
@@ -186,6 +186,19 @@ static void schedule_output_reset_timer(int iopar, double lo, double hi, double
 	}
 }
 
+/* consts, again on each reload */
+static void load_consts(void *dat)
+{
+	s.hopstaan = libio_const("opstaan");
+	s.hslapen = libio_const("slapen");
+	s.lednight = libio_const("lednight");
+	s.longitude = libio_const("longitude");
+	s.latitude = libio_const("latitude");
+	s.waitfan = libio_const("wait-fan");
+	s.waitvelux = libio_const("waitvelux");
+	s.waitveluxmorning = libio_const("waitveluxmorning");
+}
+
 /* main */
 static int ha2addons(int argc, char *argv[])
 {
@@ -213,14 +226,8 @@ static int ha2addons(int argc, char *argv[])
 	}
 	libio_set_trace(s.verbose);
 
-	s.hopstaan = libio_const("opstaan");
-	s.hslapen = libio_const("slapen");
-	s.lednight = libio_const("lednight");
-	s.longitude = libio_const("longitude");
-	s.latitude = libio_const("latitude");
-	s.waitfan = libio_const("wait-fan");
-	s.waitvelux = libio_const("waitvelux");
-	s.waitveluxmorning = libio_const("waitveluxmorning");
+	load_consts(NULL);
+	libio_add_const_notifier(load_consts, NULL);
 
 	/* wait up to 5sec for remote */
 	for (j = 0; j < 50; ++j, usleep(100000))
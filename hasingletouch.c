@@ -38,16 +38,11 @@ static const struct option long_opts[] = {
 
 static const char optstring[] = "?Vvl:i:";
 
-struct link {
-	struct link *next;
-	/* local params */
-	int out;
-};
-
 static struct args {
 	int verbose;
-	struct link *links;
-	struct link *current;
+	int *out;
+	double *values;
+	int nout;
 	int in[MAX_IN]; /* common input(s) */
 	int nin;
 	char *instr[MAX_IN];
@@ -56,7 +51,6 @@ static struct args {
 static int hasingletouch(int argc, char *argv[])
 {
 	int opt, j, changed;
-	struct link *lnk;
 	double value;
 
 	while ((opt = getopt_long(argc, argv, optstring, long_opts, NULL)) != -1)
@@ -97,13 +91,11 @@ static int hasingletouch(int argc, char *argv[])
 			elog(LOG_CRIT, 0, "failed to create %s", s.instr[j]);
 	}
 
-	for (; optind < argc; ++optind) {
-		lnk = zalloc(sizeof(*lnk));
-		lnk->out = create_iopar(argv[optind]);
-		/* append in list */
-		lnk->next = s.links;
-		s.links = lnk;
-	}
+	s.nout = argc - optind;
+	s.out = zalloc(s.nout * sizeof(*s.out));
+	s.values = zalloc(s.nout * sizeof(*s.values));
+	for (j = 0; optind < argc; ++optind, ++j)
+		s.out[j] = create_iopar(argv[optind]);
 
 	/* main ... */
 	while (1) {
@@ -118,13 +110,15 @@ static int hasingletouch(int argc, char *argv[])
 		if (changed) {
 			/* find old value: sum current value */
 			value = 0;
-			for (lnk = s.links; lnk; lnk = lnk->next)
-				value += get_iopar(lnk->out);
+			get_iopars(s.out, s.values, s.nout);
+			for (j = 0; j < s.nout; ++j)
+				value += s.values[j];
 			/* calc new value */
 			value = ((value / s.nin) >= 0.5) ? 0 : 1;
 			/* set new value */
-			for (lnk = s.links; lnk; lnk = lnk->next)
-				value += set_iopar(lnk->out, value);
+			for (j = 0; j < s.nout; ++j)
+				s.values[j] = value;
+			set_iopars(s.out, s.values, s.nout);
 		}
 
 		if (libio_wait() < 0)
@@ -52,14 +52,12 @@ static struct args {
 	.delay = 0.5,
 };
 
-static void sigchld(int sig)
+static void sigchld(int sig, void *dat)
 {
 	int pid, status;
 
 	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
 		elog(LOG_INFO, 0, "pid %u exited", pid);
-
-	signal(sig, sigchld);
 }
 
 static void starttorun(char **argv)
@@ -68,6 +66,7 @@ static void starttorun(char **argv)
 
 	pid = fork();
 	if (!pid) {
+		libio_unblock_signals();
 		elog(LOG_NOTICE, 0, "forked %u", getpid());
 		execvp(*argv, argv);
 		elog(LOG_CRIT, errno, "execvp %s ...", *argv);
@@ -117,7 +116,7 @@ static int haspawn(int argc, char *argv[])
 		ldid = -1;
 
 	/* main ... */
-	signal(SIGCHLD, sigchld);
+	libio_add_signal(SIGCHLD, sigchld, NULL);
 	while (1) {
 		if (s.type) {
 			set_longdet(ldid, get_iopar(param));
@@ -6,6 +6,7 @@
 #include <ctype.h>
 
 #include <unistd.h>
+#include <signal.h>
 
 #include "libio.h"
 
@@ -60,7 +61,7 @@ static int netiomsg_request(int argc, char *argv[])
 		/* failed */
 		return 1;
 
-	alarm(2);
+	schedule_itimerfd(2);
 	while (1) {
 		while (netio_msg_pending()) {
 			/* fetch message before testing ID! */
@@ -77,10 +78,29 @@ static int netiomsg_request(int argc, char *argv[])
 	return 1;
 }
 
+/* make libio processes log their parameter statistics */
+static int libio_stats(int argc, char *argv[])
+{
+	int j, ret = 0;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s PID [PID ...]\n", argv[0]);
+		exit(1);
+	}
+	for (j = 1; j < argc; ++j) {
+		if (kill(strtoul(argv[j], NULL, 0), SIGUSR1) < 0) {
+			elog(LOG_WARNING, errno, "kill %s", argv[j]);
+			ret = 1;
+		}
+	}
+	return ret;
+}
+
 __attribute__((constructor))
 static void add_default_applets(void)
 {
 	register_applet("consts", libio_consts);
 	register_applet("sendto", netiomsg_sendto);
 	register_applet("request", netiomsg_request);
+	register_applet("stats", libio_stats);
 }
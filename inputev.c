@@ -6,6 +6,8 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <time.h>
+#include <sys/ioctl.h>
 #include <linux/input.h>
 #include <poll.h>
 
@@ -47,11 +49,15 @@ struct evbtn {
 
 	int type;
 	int code;
+	/* time of the last event */
+	double origin;
 };
 
 struct inputdev {
 	struct inputdev *next;
 	int fd;
+	/* event times are CLOCK_MONOTONIC */
+	int monotonic;
 	struct evbtn *btns;
 	int cache[NINTS(NCODES)];
 	char file[2];
@@ -60,6 +66,13 @@ struct inputdev {
 static struct inputdev *inputdevs;
 static double debouncetime = -1; /* init to 'uninitialized */
 
+static void load_debouncetime(void *dat)
+{
+	debouncetime = libio_const("debouncetime");
+	if (isnan(debouncetime))
+		debouncetime = 0.002;
+}
+
 /* list management */
 static void add_evbtn(struct evbtn *btn, struct inputdev *dev)
 {
@@ -113,7 +126,7 @@ static void free_inputdev(struct inputdev *dev)
 	 * and refrenced by the application
 	 */
 	for (btn = dev->btns; btn; btn = btn->next) {
-		btn->iopar.value = 0;
+		iopar_value(&btn->iopar) = 0;
 		iopar_set_dirty(&btn->iopar);
 		iopar_clr_present(&btn->iopar);
 	}
@@ -125,19 +138,25 @@ static void evbtn_debounced(void *dat)
 	struct evbtn *btn = dat;
 
 	iopar_set_dirty(&btn->iopar);
+	if (btn->origin)
+		iopar_set_origin(&btn->iopar, btn->origin);
 }
 
 static void evbtn_newdata(struct evbtn *btn, const struct input_event *ev)
 {
 	/* iopar_set_present(&btn->iopar); */
-	if ((int)btn->iopar.value != ev->value) {
+	if ((int)iopar_value(&btn->iopar) != ev->value) {
 		/* always set the correct value, regardless of signalling */
-		btn->iopar.value = ev->value;
+		iopar_value(&btn->iopar) = ev->value;
+		/* the kernel's timestamp is the origin for latency tracing */
+		btn->origin = btn->dev->monotonic ?
+			ev->time.tv_sec + ev->time.tv_usec*1e-6 : 0;
 
 		if (btn->flags & FL_DEBOUNCE)
-			libt_add_timeout(debouncetime, evbtn_debounced, btn);
+			libt_add_timeout_prio(debouncetime, 0, LIBT_PRIO_HIGH,
+					evbtn_debounced, btn);
 		else
-			iopar_set_dirty(&btn->iopar);
+			evbtn_debounced(btn);
 	}
 }
 
@@ -178,6 +197,7 @@ static struct inputdev *lookup_inputdev(const char *spec)
 {
 	struct inputdev *dev;
 	char *file = NULL;
+	int clkid;
 
 	/* find device file */
 	if (!strchr(spec, '/')) {
@@ -205,12 +225,16 @@ static struct inputdev *lookup_inputdev(const char *spec)
 	if (dev->fd < 0)
 		elog(LOG_CRIT, errno, "open %s", dev->file);
 	fcntl(dev->fd, F_SETFD, fcntl(dev->fd, F_GETFD) | FD_CLOEXEC);
+	/* timestamp events in libt_now()'s timebase */
+	clkid = CLOCK_MONOTONIC;
+	dev->monotonic = ioctl(dev->fd, EVIOCSCLOCKID, &clkid) >= 0;
 
 	/* flush initial pending events */
 	read_inputdev(dev->fd, dev);
 
 	/* register */
 	libe_add_fd(dev->fd, read_inputdev, dev);
+	libe_set_prio(dev->fd, LIBE_PRIO_HIGH);
 	add_inputdev(dev);
 found:
 	if (file)
@@ -231,6 +255,10 @@ static void del_evbtn_hook(struct iopar *iopar)
 	free(btn);
 }
 
+static const struct iopar_ops evbtn_ops = {
+	.del = del_evbtn_hook,
+};
+
 struct iopar *mkinputevbtn(char *str)
 {
 	struct evbtn *btn;
@@ -239,9 +267,7 @@ struct iopar *mkinputevbtn(char *str)
 	int flag;
 
 	btn = zalloc(sizeof(*btn));
-	btn->iopar.del = del_evbtn_hook;
-	btn->iopar.set = NULL;
-	btn->iopar.value = 0;
+	iopar_init(&btn->iopar, &evbtn_ops);
 
 	dev = lookup_inputdev(strtok(str, ":;,") ?: "/dev/input/event0");
 	btn->type = strtoul(strtok(NULL, ":;,") ?: "1", NULL, 0);
@@ -259,9 +285,9 @@ struct iopar *mkinputevbtn(char *str)
 
 	/* make sure debounce time has been read */
 	if ((debouncetime < 0) && (btn->flags & FL_DEBOUNCE)) {
-		debouncetime = libio_const("debouncetime");
-		if (isnan(debouncetime))
-			debouncetime = 0.002;
+		load_debouncetime(NULL);
+		/* follow edits of the config */
+		libio_add_const_notifier(load_debouncetime, NULL);
 	}
 	/* TODO: test input device for type:code presence */
 
@@ -271,11 +297,11 @@ struct iopar *mkinputevbtn(char *str)
 	add_evbtn(btn, dev);
 	/* set as present */
 	iopar_set_present(&btn->iopar);
-	btn->iopar.state &= ~ST_DIRTY;
+	iopar_state(&btn->iopar) &= ~ST_DIRTY;
 
 	/* test initial state */
 	if ((btn->type == EV_KEY) && getbit(btn->code, dev->cache)) {
-		btn->iopar.value = 1;
+		iopar_value(&btn->iopar) = 1;
 		iopar_set_dirty(&btn->iopar);
 	}
 	return &btn->iopar;
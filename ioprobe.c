@@ -87,7 +87,7 @@ static int ioprobe(int argc, char *argv[])
 	}
 
 	if (!follow)
-	schedule_itimer(2);
+	schedule_itimerfd(2);
 
 	/* main ... */
 	while (1) {
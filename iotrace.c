@@ -253,7 +253,7 @@ static void parse_param(struct ent *e, char *str)
 
 static void trace_timeout(void *dat)
 {
-	libt_add_timeout(1.1, trace_timeout, dat);
+	libt_add_timeout_slack(1.1, 1.1/4, trace_timeout, dat);
 }
 
 /* main */
@@ -320,7 +320,7 @@ static int iotrace(int argc, char *argv[])
 	}
 
 	libio_set_trace(s.verbose);
-	libt_add_timeout(1.1, trace_timeout, NULL);
+	libt_add_timeout_slack(1.1, 1.1/4, trace_timeout, NULL);
 	/* main ... */
 	while (1) {
 		/* netio msgs */
@@ -4,11 +4,14 @@
 #include <errno.h>
 #include <math.h>
 
+#include <fcntl.h>
+
 #include "_libio.h"
 
 struct led {
 	struct iopar iopar;
 	char *sysfs;
+	struct attr *attr;
 	int max;
 };
 
@@ -21,31 +24,21 @@ static int led_set(struct iopar *iopar, double value)
 {
 	struct led *led = (struct led *)iopar;
 	int ret;
-	FILE *fp;
 
 	/* NAN may be passed to release control */
 	if (isnan(value))
 		value = 0;
-	fp = fopen(led->sysfs, "w");
-	if (!fp) {
-		if (led->iopar.state & ST_PRESENT)
-			elog(LOG_WARNING, errno, "fopen %s", led->sysfs);
-		goto fail_open;
-	}
-	ret = fprintf(fp, "%u", fit_int(value*led->max, 0, led->max));
+	ret = attr_pwritef(led->attr, "%u", fit_int(value*led->max, 0, led->max));
 	if (ret < 0) {
-		if (led->iopar.state & ST_PRESENT)
-			elog(LOG_WARNING, errno, "fwrite %s", led->sysfs);
+		if (iopar_state(&led->iopar) & ST_PRESENT)
+			elog(LOG_WARNING, errno, "write %s", led->sysfs);
 		goto fail_write;
 	}
-	fclose(fp);
-	led->iopar.value = value;
+	iopar_value(&led->iopar) = value;
 	iopar_set_present(&led->iopar);
 	return ret;
 
 fail_write:
-	fclose(fp);
-fail_open:
 	iopar_clr_present(&led->iopar);
 	return -1;
 }
@@ -60,9 +53,21 @@ static void del_led(struct iopar *iopar)
 	struct led *led = (struct led *)iopar;
 
 	cleanup_libiopar(&led->iopar);
+	attr_close(led->attr);
+	free(led->sysfs);
 	free(led);
 }
 
+static const struct iopar_ops led_ops = {
+	.del = del_led,
+	.set = led_set,
+};
+
+static const struct iopar_ops led_bool_ops = {
+	.del = del_led,
+	.set = led_set_bool,
+};
+
 static const char *const led_opts[] = {
 	"bool",
 	NULL,
@@ -74,18 +79,18 @@ struct iopar *mkled(char *str)
 	const char *name = strtok(str, ",");
 
 	led = zalloc(sizeof(*led));
+	iopar_init(&led->iopar, &led_ops);
 	asprintf(&led->sysfs, "/sys/class/leds/%s/brightness", name);
-	led->iopar.del = del_led;
-	led->iopar.set = led_set;
+	led->attr = attr_open(led->sysfs, O_WRONLY);
 	led->max = attr_read(255, "/sys/class/leds/%s/max_brightness", name);
-	led->iopar.value = attr_read(0, led->sysfs) / (double)led->max;
+	iopar_value(&led->iopar) = attr_read(0, led->sysfs) / (double)led->max;
 	iopar_set_present(&led->iopar);
 
 	while ((str = strtok(NULL, ",")) != NULL)
 	switch (strlookup(str, led_opts)) {
 	case 0:
-		led->iopar.set = led_set_bool;
-		led->iopar.value = (led->iopar.value < 0.5) ? 0 : 1;
+		iopar_set_ops(&led->iopar, &led_bool_ops);
+		iopar_value(&led->iopar) = (iopar_value(&led->iopar) < 0.5) ? 0 : 1;
 		break;
 	}
 	return &led->iopar;
@@ -98,11 +103,12 @@ struct iopar *mkbacklight(char *str)
 	const char *name = strtok(str, ",");
 
 	led = zalloc(sizeof(*led));
+	iopar_init(&led->iopar, &led_ops);
 	asprintf(&led->sysfs, "/sys/class/backlight/%s/brightness", name);
-	led->iopar.set = led_set;
+	led->attr = attr_open(led->sysfs, O_WRONLY);
 	led->max = attr_read(255, "/sys/class/backlight/%s/max_brightness", name);
 	/* the default value is read elsewhere compared to leds */
-	led->iopar.value = attr_read(led->max / 2,
+	iopar_value(&led->iopar) = attr_read(led->max / 2,
 			"/sys/class/backlight/%s/actual_brightness", name)
 		/ (double)led->max;
 	iopar_set_present(&led->iopar);
@@ -0,0 +1,162 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This file is part of libet.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Public License for more details.
+ *
+ * You should have received a copy of the GNU Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * libe benchmark: cost per loop iteration with many busy fds,
+ * for the epoll and io_uring backends.
+ * The syscalls per loop count those of libe and of the handlers.
+ *
+ * Build: gcc -O2 -DUSE_IO_URING -o benchlibe benchlibe.c libe.c
+ * Run: ./benchlibe [et]; LIBE_BACKEND=epoll ./benchlibe [et]
+ * 'et' watches the fds edge-triggered.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "libe.h"
+
+#define NFDS	256
+#define NLOOPS	20000
+
+static int pairs[NFDS][2];
+static unsigned long nreads, nsys;
+static int edge, filefd;
+static char filebuf[NFDS][64];
+
+static double now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/* handler that reads itself */
+static void readfd(int fd, void *dat)
+{
+	char buf[16];
+
+	for (++nsys; recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0; ++nsys)
+		++nreads;
+}
+
+/* libe_add_recv handler */
+static void recvfd(int fd, const void *buf, int len,
+		const struct sockaddr *name, int namelen, void *dat)
+{
+	if (len > 0)
+		++nreads;
+}
+
+static void readdone(int ret, void *dat)
+{
+	if (ret > 0)
+		++nreads;
+}
+
+static void watch(int how)
+{
+	int j;
+
+	for (j = 0; j < NFDS; ++j) {
+		if (how)
+			libe_add_recv(pairs[j][0], recvfd, NULL);
+		else
+			libe_add_fd(pairs[j][0], readfd, NULL);
+		if (edge)
+			libe_mod_fd(pairs[j][0], LIBE_RD | LIBE_ET);
+	}
+}
+
+/*
+ * @io 0: the load is sent directly
+ * @io 1: the load is sent with libe_sendto, and as many libe_preads
+ */
+static void bench(const char *what, int nactive, int io)
+{
+	int j, k, fd;
+	double t0;
+	unsigned long sys0;
+
+	nreads = nsys = 0;
+	sys0 = libe_nsyscalls();
+	t0 = now();
+	for (j = 0; j < NLOOPS; ++j) {
+		for (k = 0; k < nactive; ++k) {
+			fd = pairs[rand() % NFDS][1];
+			if (!io) {
+				send(fd, "x", 1, MSG_DONTWAIT);
+				continue;
+			}
+			libe_sendto(fd, "x", 1, NULL, 0, NULL, NULL);
+			libe_pread(filefd, filebuf[k], sizeof(filebuf[k]), 0,
+					readdone, NULL);
+		}
+		libe_wait(0);
+		libe_flush();
+	}
+	printf("%-8s %s %-9s %3i active: %8.1lf ns/loop, %6.2lf syscalls/loop, %6.2lf reads/loop\n",
+			libe_backend(), edge ? "et" : "lt", what, nactive,
+			(now() - t0) * 1e9 / NLOOPS,
+			(libe_nsyscalls() - sys0 + nsys) * 1.0 / NLOOPS,
+			nreads * 1.0 / NLOOPS);
+	/* drain */
+	for (j = 0; j < 4; ++j) {
+		libe_wait(0);
+		libe_flush();
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	char file[] = "/tmp/benchlibeXXXXXX";
+	int j;
+
+	edge = argv[1] && !strcmp(argv[1], "et");
+	for (j = 0; j < NFDS; ++j) {
+		if (socketpair(AF_UNIX, SOCK_DGRAM, 0, pairs[j]) < 0) {
+			perror("socketpair");
+			return 1;
+		}
+	}
+	filefd = mkstemp(file);
+	if (filefd < 0) {
+		perror("mkstemp");
+		return 1;
+	}
+	unlink(file);
+	write(filefd, "12345\n", 6);
+
+	watch(0);
+	bench("read", 1, 0);
+	bench("read", 8, 0);
+	bench("read", 64, 0);
+	watch(1);
+	bench("recv", 1, 0);
+	bench("recv", 8, 0);
+	bench("recv", 64, 0);
+	bench("send+pread", 1, 1);
+	bench("send+pread", 8, 1);
+	bench("send+pread", 64, 1);
+	return 0;
+}
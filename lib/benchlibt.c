@@ -0,0 +1,123 @@
+/*
+ * Copyright 2015 Kurt Van Dijck <dev.kurt@vandijck-laurijssen.be>
+ *
+ * This file is part of libet.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Public License for more details.
+ *
+ * You should have received a copy of the GNU Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/*
+ * libt microbenchmark: cost per timer operation
+ * for an increasing number of scheduled timers.
+ *
+ * Build: gcc -O2 -o benchlibt benchlibt.c libt.c -lm
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "libt.h"
+
+static void function(void *dat)
+{
+}
+
+/* pseudo random timeout, far enough to never expire during the test */
+static double rndtimeout(void)
+{
+	return 1000 + (rand() % 100000) / 100.0;
+}
+
+static void report(const char *what, int n, double t0)
+{
+	printf("%8i %-24s %8.1lf ns/op\n", n, what, (libt_now() - t0) * 1e9 / n);
+}
+
+static void bench_fndat(int n)
+{
+	long j;
+	double t0;
+
+	t0 = libt_now();
+	for (j = 0; j < n; ++j)
+		libt_add_timeout(rndtimeout(), function, (void *)j);
+	report("libt_add_timeout", n, t0);
+
+	t0 = libt_now();
+	for (j = 0; j < n; ++j)
+		libt_repeat_timeout(rndtimeout(), function, (void *)j);
+	report("libt_repeat_timeout", n, t0);
+
+	t0 = libt_now();
+	for (j = 0; j < n; ++j)
+		libt_timeout_exist(function, (void *)j);
+	report("libt_timeout_exist", n, t0);
+
+	t0 = libt_now();
+	for (j = 0; j < n; ++j)
+		libt_remove_timeout(function, (void *)j);
+	report("libt_remove_timeout", n, t0);
+}
+
+static void bench_handle(int n)
+{
+	struct libt_timer **t;
+	long j;
+	double t0;
+
+	t = malloc(sizeof(*t) * n);
+	for (j = 0; j < n; ++j)
+		t[j] = libt_timer_new(function, (void *)j);
+
+	t0 = libt_now();
+	for (j = 0; j < n; ++j)
+		libt_timer_add(t[j], rndtimeout());
+	report("libt_timer_add", n, t0);
+
+	t0 = libt_now();
+	for (j = 0; j < n; ++j)
+		libt_timer_repeat(t[j], rndtimeout());
+	report("libt_timer_repeat", n, t0);
+
+	t0 = libt_now();
+	for (j = 0; j < n; ++j)
+		libt_timer_cancel(t[j]);
+	report("libt_timer_cancel", n, t0);
+
+	for (j = 0; j < n; ++j)
+		libt_timer_free(t[j]);
+	free(t);
+}
+
+static void bench_flush(int n)
+{
+	long j;
+	double t0;
+
+	for (j = 0; j < n; ++j)
+		libt_add_timeout(0, function, (void *)j);
+	t0 = libt_now();
+	libt_flush();
+	report("libt_flush (expire)", n, t0);
+}
+
+int main(int argc, char *argv[])
+{
+	int n;
+
+	for (n = 100; n <= 100000; n *= 10) {
+		bench_fndat(n);
+		bench_handle(n);
+		bench_flush(n);
+	}
+	return 0;
+}
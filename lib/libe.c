@@ -17,66 +17,642 @@
  * along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
 
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
+#ifdef USE_IO_URING
+#include <endian.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#ifndef IORING_RECV_MULTISHOT
+#error USE_IO_URING needs linux headers 6.0 or newer
+#endif
+#endif
 
 #include "libe.h"
 
 struct event {
-	struct event *next, *prev;
 	void (*fn)(int fd, void *dat);
+	/* called when writable */
+	void (*wrfn)(int fd, void *dat);
+	/* called per datagram, see libe_add_recv */
+	void (*recvfn)(int fd, const void *buf, int len,
+			const struct sockaddr *name, int namelen, void *dat);
 	void *dat;
 	int fd;
+	int flags;
+	int prio;
+	/* distinguishes a re-used fd during libe_flush */
+	uint32_t gen;
+#ifdef USE_IO_URING
+	/* distinguishes a re-armed poll, and recv */
+	uint32_t ugen, rgen;
+#endif
 };
 
-static struct {
-	struct event *events;
+#ifdef USE_IO_URING
+/* a queued pread or sendto */
+struct ioreq {
+	struct ioreq *next;
+	void (*done)(int ret, void *dat);
+	void *dat;
+	int ret;
+	/* sendto */
+	struct msghdr msg;
+	struct iovec iov;
+	struct sockaddr_storage name;
+	char buf[];
+};
+
+/* a received datagram, in a provided buffer */
+struct urecv {
+	uint64_t data;
+	int bid;
+	int res;
+	int done;
+};
+
+/* provided buffers for multishot recvmsg */
+#define UBGID		0
+#define UNBUFS		64
+#define UBUFSIZE	(sizeof(struct io_uring_recvmsg_out) + \
+		sizeof(struct sockaddr_storage) + LIBE_RECVSIZE)
+
+struct uring {
+	int fd;
+	unsigned *sqhead, *sqtail, *sqmask, *sqarray, sqentries;
+	struct io_uring_sqe *sqes;
+	unsigned *cqhead, *cqtail, *cqmask;
+	struct io_uring_cqe *cqes;
+	void *sqring, *cqring;
+	size_t sqringsize, cqringsize, sqessize;
+	unsigned nsubmit;
+	uint32_t ugen;
+	/* completed requests, for libe_flush */
+	struct ioreq *cplt, *cpltlast;
+	/* received datagrams, for libe_flush */
+	struct urecv *recvs;
+	int nrecvs, srecvs;
+	/* provided buffer ring, NULL until needed */
+	struct io_uring_buf_ring *br;
+	char *bufs;
+	int nopbuf;
+	struct msghdr rmsg;
+};
+#endif
+
+struct libe {
+	/* registered events, indexed by fd */
+	struct event **fds;
+	int nfds;
+	uint32_t gen;
 	int epfd; /* epoll file descriptor */
-	int nevs;
+	int nevs, sevs;
+	int full; /* the last epoll_wait filled evs */
 	#define NEVS	16
-	struct epoll_event evs[NEVS];
-} s = {
-	.epfd = -1,
+	#define MAXNEVS	1024
+	struct epoll_event *evs;
+	unsigned long nsyscalls;
+	/* dispatch latency, per priority class */
+	double waketime;
+	struct {
+		unsigned long n;
+		double sum, max;
+	} lat[LIBE_NPRIO];
+#ifdef USE_IO_URING
+	struct uring u;
+#endif
 };
 
-/* double-linked-list black magic:
- * The @prev member of the first element points to a 'fake' element
- * which is well-crafted so that assigning prev->next just happens
- * to set the root pointer
- * This function return the required 'fake' pointers
+#ifdef USE_IO_URING
+#define LIBE_INIT	{ .epfd = -1, .u.fd = -1, }
+#else
+#define LIBE_INIT	{ .epfd = -1, }
+#endif
+static struct libe defctx = LIBE_INIT;
+/* current context of this thread */
+static __thread struct libe *s = &defctx;
+
+static double e_now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + (t.tv_nsec / 1e9);
+}
+
+static inline struct event *e_lookup(int fd)
+{
+	return ((fd >= 0) && (fd < s->nfds)) ? s->fds[fd] : NULL;
+}
+
+static inline uint32_t e_pollmask(const struct event *t)
+{
+	return ((t->flags & LIBE_RD) ? EPOLLIN : 0) |
+		((t->flags & LIBE_WR) ? EPOLLOUT : 0) |
+		((t->flags & LIBE_PRI) ? EPOLLPRI : 0);
+}
+
+static inline uint64_t e_data(const struct event *t)
+{
+	return ((uint64_t)t->gen << 32) | (uint32_t)t->fd;
+}
+
+/* io_uring backend
+ * Each fd has a poll request in the ring. Edge-triggered fds use
+ * a multishot poll. Level-triggered fds use a oneshot poll that is
+ * re-armed after it fired, which tests the fd again on the next
+ * submission.
+ * Datagram receivers use a multishot recvmsg into provided buffers
+ * instead of polling for input, so packets arrive without syscalls.
+ * (Re-)arming, preads and sends only fill the submission queue,
+ * the next libe_wait submits them together with waiting
+ * in 1 io_uring_enter.
+ *
+ * user_data is a request pointer with U_REQ set,
+ * or (ugen << 32) | fd, where ugen 0 is a request without reply.
  */
-static inline struct event *t_fakeelement(struct event **root)
+#ifdef USE_IO_URING
+#define U_REQ	(1ULL << 63)
+
+static uint32_t u_nextgen(void)
 {
-	return (struct event *)(((char *)root) - offsetof(struct event, next));
+	s->u.ugen = (s->u.ugen + 1) & 0x7fffffff;
+	if (!s->u.ugen)
+		++s->u.ugen;
+	return s->u.ugen;
+}
 
+static int u_enter(unsigned nsubmit, unsigned mincomplete, unsigned flags,
+		void *arg, size_t argsize)
+{
+	++s->nsyscalls;
+	return syscall(__NR_io_uring_enter, s->u.fd, nsubmit, mincomplete, flags,
+			arg, argsize);
 }
 
-/* double linked list */
-static void t_del(struct event *t)
+static struct io_uring_sqe *u_get_sqe(void)
 {
-	if (t->next)
-		t->next->prev = t->prev;
-	if (t->prev)
-		t->prev->next = t->next;
-	t->next = t->prev = NULL;
+	unsigned tail = *s->u.sqtail, idx;
+	struct io_uring_sqe *sqe;
+
+	if (tail - __atomic_load_n(s->u.sqhead, __ATOMIC_ACQUIRE) >= s->u.sqentries) {
+		/* submission queue full, submit without waiting */
+		if (u_enter(s->u.nsubmit, 0, 0, NULL, 0) >= 0)
+			s->u.nsubmit = 0;
+	}
+	idx = tail & *s->u.sqmask;
+	sqe = &s->u.sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	s->u.sqarray[idx] = idx;
+	__atomic_store_n(s->u.sqtail, tail + 1, __ATOMIC_RELEASE);
+	++s->u.nsubmit;
+	return sqe;
+}
+
+static void u_poll_add(struct event *t)
+{
+	struct io_uring_sqe *sqe;
+	uint32_t mask = e_pollmask(t);
+
+	if (t->recvfn && s->u.br)
+		/* input arrives via recvmsg */
+		mask &= ~EPOLLIN;
+	if (!mask) {
+		t->ugen = 0;
+		return;
+	}
+	t->ugen = u_nextgen();
+	sqe = u_get_sqe();
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = t->fd;
+#if __BYTE_ORDER == __BIG_ENDIAN
+	mask = (mask << 16) | (mask >> 16);
+#endif
+	sqe->poll32_events = mask;
+	if (t->flags & LIBE_ET)
+		sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = ((uint64_t)t->ugen << 32) | (uint32_t)t->fd;
 }
 
-static void t_add(struct event *t, struct event **root)
+static void u_poll_remove(struct event *t)
 {
-	t_del(t);
-	t->next = *root;
-	if (t->next) {
-		t->prev = t->next->prev;
-		t->next->prev = t;
-	} else
-		/* this is dirty: fake a event struct, which will only be used
-		 * for setting the @next member
+	struct io_uring_sqe *sqe;
+
+	if (!t->ugen)
+		return;
+	sqe = u_get_sqe();
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = ((uint64_t)t->ugen << 32) | (uint32_t)t->fd;
+	sqe->user_data = 0;
+	t->ugen = 0;
+}
+
+/* provided buffers */
+static void u_buf_return(int bid)
+{
+	struct io_uring_buf *buf;
+	unsigned short tail = s->u.br->tail;
+
+	/* don't touch buf->resv, the first one holds the tail */
+	buf = &s->u.br->bufs[tail & (UNBUFS-1)];
+	buf->addr = (uintptr_t)(s->u.bufs + bid*UBUFSIZE);
+	buf->len = UBUFSIZE;
+	buf->bid = bid;
+	__atomic_store_n(&s->u.br->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static void u_pbuf_setup(void)
+{
+	struct io_uring_buf_reg reg = {
+		.ring_entries = UNBUFS,
+		.bgid = UBGID,
+	};
+	void *br;
+	int j;
+
+	br = mmap(NULL, UNBUFS*sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (br == MAP_FAILED)
+		goto fail;
+	reg.ring_addr = (uintptr_t)br;
+	++s->nsyscalls;
+	if (syscall(__NR_io_uring_register, s->u.fd, IORING_REGISTER_PBUF_RING,
+				&reg, 1) < 0) {
+		munmap(br, UNBUFS*sizeof(struct io_uring_buf));
+		goto fail;
+	}
+	s->u.br = br;
+	s->u.bufs = malloc(UNBUFS*UBUFSIZE);
+	/* don't test, see libe_add_fd */
+	for (j = 0; j < UNBUFS; ++j)
+		u_buf_return(j);
+	s->u.rmsg.msg_namelen = sizeof(struct sockaddr_storage);
+	return;
+fail:
+	/* poll & recvfrom instead */
+	s->u.nopbuf = 1;
+}
+
+static void u_recv_add(struct event *t)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!s->u.br && !s->u.nopbuf)
+		u_pbuf_setup();
+	if (!s->u.br)
+		return;
+	t->rgen = u_nextgen();
+	sqe = u_get_sqe();
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = t->fd;
+	sqe->addr = (uintptr_t)&s->u.rmsg;
+	sqe->len = 1;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = UBGID;
+	sqe->user_data = ((uint64_t)t->rgen << 32) | (uint32_t)t->fd;
+}
+
+static void u_recv_remove(struct event *t)
+{
+	struct io_uring_sqe *sqe;
+
+	if (!t->rgen)
+		return;
+	sqe = u_get_sqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = ((uint64_t)t->rgen << 32) | (uint32_t)t->fd;
+	sqe->user_data = 0;
+	t->rgen = 0;
+	/* submit now, a later datagram is for a new receiver */
+	if (u_enter(s->u.nsubmit, 0, 0, NULL, 0) >= 0)
+		s->u.nsubmit = 0;
+}
+
+/* a recvmsg completion */
+static void u_recv_cqe(struct event *t, const struct io_uring_cqe *cqe)
+{
+	struct urecv *r;
+
+	if (!(cqe->flags & IORING_CQE_F_MORE)) {
+		/* terminated, like when out of buffers: re-arm.
+		 * The buffers return during libe_flush,
+		 * before the next submission.
 		 */
-		t->prev = t_fakeelement(root);
-	t->prev->next = t;
+		t->rgen = 0;
+		u_recv_add(t);
+	}
+	if (!(cqe->flags & IORING_CQE_F_BUFFER) &&
+			((cqe->res >= 0) || (cqe->res == -ENOBUFS) ||
+			 (cqe->res == -ECANCELED)))
+		return;
+	if (s->u.nrecvs >= s->u.srecvs) {
+		s->u.srecvs = s->u.srecvs ? s->u.srecvs*2 : UNBUFS;
+		s->u.recvs = realloc(s->u.recvs, sizeof(*s->u.recvs)*s->u.srecvs);
+		/* don't test, see libe_add_fd */
+	}
+	r = &s->u.recvs[s->u.nrecvs++];
+	r->data = e_data(t);
+	r->bid = (cqe->flags & IORING_CQE_F_BUFFER) ?
+		(cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+	r->res = cqe->res;
+	r->done = 0;
+}
+
+static void u_recv_dispatch(struct event *t, const struct urecv *r)
+{
+	const struct io_uring_recvmsg_out *out;
+	const char *name, *payload;
+	int namelen, len;
+
+	if (r->bid < 0) {
+		t->recvfn(t->fd, NULL, r->res, NULL, 0, t->dat);
+		return;
+	}
+	out = (const void *)(s->u.bufs + r->bid*UBUFSIZE);
+	name = (const char *)(out + 1);
+	payload = name + s->u.rmsg.msg_namelen;
+	len = r->res - (payload - (const char *)out);
+	if (len > out->payloadlen)
+		len = out->payloadlen;
+	namelen = out->namelen;
+	if (namelen > s->u.rmsg.msg_namelen)
+		namelen = s->u.rmsg.msg_namelen;
+	t->recvfn(t->fd, payload, len, (const void *)name, namelen, t->dat);
+}
+
+/* requests */
+static struct ioreq *u_new_req(int size, void (*done)(int, void *),
+		const void *dat)
+{
+	struct ioreq *req;
+
+	req = malloc(sizeof(*req) + size);
+	/* don't test, see libe_add_fd */
+	memset(req, 0, sizeof(*req));
+	req->done = done;
+	req->dat = (void *)dat;
+	return req;
+}
+
+static void u_req_done(struct ioreq *req, int res)
+{
+	if (!req->done) {
+		free(req);
+		return;
+	}
+	req->ret = res;
+	req->next = NULL;
+	if (s->u.cpltlast)
+		s->u.cpltlast->next = req;
+	else
+		s->u.cplt = req;
+	s->u.cpltlast = req;
+}
+
+static void u_cleanup(void)
+{
+	struct io_uring_cqe *cqe;
+	struct ioreq *req;
+	unsigned head;
+
+	if ((s->u.fd >= 0) && s->u.nsubmit)
+		/* don't lose queued sends */
+		u_enter(s->u.nsubmit, 0, 0, NULL, 0);
+	if (s->u.cqring) {
+		/* free completed requests */
+		head = *s->u.cqhead;
+		for (; head != __atomic_load_n(s->u.cqtail, __ATOMIC_ACQUIRE); ++head) {
+			cqe = &s->u.cqes[head & *s->u.cqmask];
+			if (cqe->user_data & U_REQ)
+				free((void *)(uintptr_t)(cqe->user_data & ~U_REQ));
+		}
+		__atomic_store_n(s->u.cqhead, head, __ATOMIC_RELEASE);
+	}
+	while (s->u.cplt) {
+		req = s->u.cplt;
+		s->u.cplt = req->next;
+		free(req);
+	}
+	s->u.cpltlast = NULL;
+	free(s->u.recvs);
+	s->u.recvs = NULL;
+	s->u.nrecvs = s->u.srecvs = 0;
+	if (s->u.br)
+		munmap(s->u.br, UNBUFS*sizeof(struct io_uring_buf));
+	s->u.br = NULL;
+	free(s->u.bufs);
+	s->u.bufs = NULL;
+	s->u.nopbuf = 0;
+	if (s->u.cqring && (s->u.cqring != s->u.sqring))
+		munmap(s->u.cqring, s->u.cqringsize);
+	if (s->u.sqring)
+		munmap(s->u.sqring, s->u.sqringsize);
+	if (s->u.sqes)
+		munmap(s->u.sqes, s->u.sqessize);
+	s->u.sqring = s->u.cqring = NULL;
+	s->u.sqes = NULL;
+	if (s->u.fd >= 0)
+		close(s->u.fd);
+	s->u.fd = -1;
+}
+
+static int u_start(void)
+{
+	struct io_uring_params p = {};
+	const char *backend = getenv("LIBE_BACKEND");
+	int fd;
+
+	if (backend && strcmp(backend, "io_uring"))
+		return -1;
+	s->u.fd = syscall(__NR_io_uring_setup, 256, &p);
+	if (s->u.fd < 0)
+		return -1;
+	if (!(p.features & IORING_FEAT_EXT_ARG))
+		/* we need a timeout on io_uring_enter */
+		goto fail;
+	s->u.sqringsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	s->u.cqringsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (s->u.cqringsize > s->u.sqringsize)
+			s->u.sqringsize = s->u.cqringsize;
+		s->u.cqringsize = s->u.sqringsize;
+	}
+	s->u.sqring = mmap(NULL, s->u.sqringsize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, s->u.fd, IORING_OFF_SQ_RING);
+	if (s->u.sqring == MAP_FAILED) {
+		s->u.sqring = NULL;
+		goto fail;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		s->u.cqring = s->u.sqring;
+	else {
+		s->u.cqring = mmap(NULL, s->u.cqringsize, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, s->u.fd, IORING_OFF_CQ_RING);
+		if (s->u.cqring == MAP_FAILED) {
+			s->u.cqring = NULL;
+			goto fail;
+		}
+	}
+	s->u.sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+	s->u.sqes = mmap(NULL, s->u.sqessize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, s->u.fd, IORING_OFF_SQES);
+	if (s->u.sqes == MAP_FAILED) {
+		s->u.sqes = NULL;
+		goto fail;
+	}
+	s->u.sqhead = s->u.sqring + p.sq_off.head;
+	s->u.sqtail = s->u.sqring + p.sq_off.tail;
+	s->u.sqmask = s->u.sqring + p.sq_off.ring_mask;
+	s->u.sqarray = s->u.sqring + p.sq_off.array;
+	s->u.sqentries = p.sq_entries;
+	s->u.cqhead = s->u.cqring + p.cq_off.head;
+	s->u.cqtail = s->u.cqring + p.cq_off.tail;
+	s->u.cqmask = s->u.cqring + p.cq_off.ring_mask;
+	s->u.cqes = s->u.cqring + p.cq_off.cqes;
+	s->u.nsubmit = 0;
+
+	for (fd = 0; fd < s->nfds; ++fd) {
+		if (!s->fds[fd])
+			continue;
+		if (s->fds[fd]->recvfn)
+			u_recv_add(s->fds[fd]);
+		u_poll_add(s->fds[fd]);
+	}
+	return 0;
+fail:
+	u_cleanup();
+	return -1;
+}
+
+static int u_wait(int waitmsec)
+{
+	struct __kernel_timespec ts = {
+		.tv_sec = waitmsec / 1000,
+		.tv_nsec = (waitmsec % 1000) * 1000000,
+	};
+	struct io_uring_getevents_arg arg = {
+		.ts = (waitmsec >= 0) ? (uintptr_t)&ts : 0,
+	};
+	struct io_uring_cqe *cqe;
+	struct event *t;
+	unsigned head, tail;
+	uint32_t gen;
+	int ret;
+
+	head = *s->u.cqhead;
+	tail = __atomic_load_n(s->u.cqtail, __ATOMIC_ACQUIRE);
+	ret = u_enter(s->u.nsubmit, (head == tail) ? 1 : 0,
+			IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+			&arg, sizeof(arg));
+	if (ret < 0 && errno != ETIME)
+		return ret;
+	s->u.nsubmit = 0;
+
+	tail = __atomic_load_n(s->u.cqtail, __ATOMIC_ACQUIRE);
+	for (s->nevs = 0; head != tail; ++head) {
+		cqe = &s->u.cqes[head & *s->u.cqmask];
+		if (cqe->user_data & U_REQ) {
+			u_req_done((void *)(uintptr_t)(cqe->user_data & ~U_REQ),
+					cqe->res);
+			continue;
+		}
+		t = e_lookup((uint32_t)cqe->user_data);
+		gen = cqe->user_data >> 32;
+		if (t && gen && (gen == t->rgen)) {
+			u_recv_cqe(t, cqe);
+			continue;
+		}
+		if (cqe->flags & IORING_CQE_F_BUFFER)
+			/* a receiver that was removed */
+			u_buf_return(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+		if (!t || !gen || (gen != t->ugen))
+			/* stale, or a request without reply */
+			continue;
+		if (s->nevs >= s->sevs)
+			/* keep it for the next call */
+			break;
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			/* poll terminated, re-arm */
+			u_poll_add(t);
+		if (cqe->res < 0)
+			continue;
+		s->evs[s->nevs].events = cqe->res;
+		s->evs[s->nevs].data.u64 = e_data(t);
+		++s->nevs;
+	}
+	__atomic_store_n(s->u.cqhead, head, __ATOMIC_RELEASE);
+	s->full = (s->nevs == s->sevs);
+	return s->nevs + s->u.nrecvs + !!s->u.cplt;
+}
+#endif
+
+/* backend */
+static int e_ctl(int op, struct event *t)
+{
+	struct epoll_event evdat = {
+		.events = e_pollmask(t) | ((t->flags & LIBE_ET) ? EPOLLET : 0),
+		.data.u64 = e_data(t),
+	};
+
+#ifdef USE_IO_URING
+	if (s->u.fd >= 0) {
+		if (op != EPOLL_CTL_ADD)
+			u_poll_remove(t);
+		if (op == EPOLL_CTL_DEL)
+			u_recv_remove(t);
+		if ((op == EPOLL_CTL_ADD) && t->recvfn)
+			u_recv_add(t);
+		if (op != EPOLL_CTL_DEL)
+			u_poll_add(t);
+		return 0;
+	}
+#endif
+	if (s->epfd < 0)
+		/* not started yet */
+		return 0;
+	++s->nsyscalls;
+	return epoll_ctl(s->epfd, op, t->fd, &evdat);
+}
+
+static int e_start(void)
+{
+	int ret, fd;
+
+#ifdef USE_IO_URING
+	if (s->u.fd >= 0)
+		return 0;
+	if (s->epfd < 0 && u_start() >= 0)
+		return 0;
+#endif
+	if (s->epfd >= 0)
+		return 0;
+	/* start EPOLL */
+	ret = s->epfd = epoll_create(NEVS);
+	if (ret < 0)
+		return ret;
+	for (fd = 0; fd < s->nfds; ++fd) {
+		if (!s->fds[fd])
+			continue;
+		ret = e_ctl(EPOLL_CTL_ADD, s->fds[fd]);
+		if (ret < 0) {
+			close(s->epfd);
+			s->epfd = -1;
+			return ret;
+		}
+	}
+	return 0;
 }
 
 /* exported API */
@@ -84,6 +660,21 @@ int libe_add_fd(int fd, void (*fn)(int fd, void *), const void *dat)
 {
 	struct event *t;
 
+	if (fd < 0) {
+		errno = EBADF;
+		return -1;
+	}
+	if (fd >= s->nfds) {
+		int oldnfds = s->nfds;
+
+		s->nfds = (fd + 16) & ~15;
+		s->fds = realloc(s->fds, sizeof(*s->fds)*s->nfds);
+		/* don't test, see below */
+		memset(s->fds + oldnfds, 0, sizeof(*s->fds)*(s->nfds - oldnfds));
+	}
+	/* replace a previous registration */
+	libe_remove_fd(fd);
+
 	t = malloc(sizeof(*t));
 	/* don't test t since I don't know what to do if it was NULL
 	 * So, I just use it, and maybe we segfault, which is the best
@@ -93,99 +684,381 @@ int libe_add_fd(int fd, void (*fn)(int fd, void *), const void *dat)
 	t->fd = fd;
 	t->fn = fn;
 	t->dat = (void *)dat;
+	t->flags = LIBE_RD;
+	t->prio = LIBE_PRIO_NORMAL;
+	t->gen = ++s->gen;
+
+	s->fds[fd] = t;
+	return e_ctl(EPOLL_CTL_ADD, t);
+}
+
+int libe_add_recv(int fd, void (*fn)(int fd, const void *buf, int len,
+			const struct sockaddr *name, int namelen, void *dat),
+		const void *dat)
+{
+	struct event *t;
+	int ret;
+
+	ret = libe_add_fd(fd, NULL, dat);
+	if (ret < 0)
+		return ret;
+	t = e_lookup(fd);
+	t->recvfn = fn;
+#ifdef USE_IO_URING
+	if (s->u.fd >= 0) {
+		/* replace the input poll with recvmsg */
+		u_poll_remove(t);
+		u_recv_add(t);
+		u_poll_add(t);
+	}
+#endif
+	return 0;
+}
+
+int libe_mod_fd(int fd, int flags)
+{
+	struct event *t = e_lookup(fd);
+
+	if (!t) {
+		errno = ENOENT;
+		return -1;
+	}
+	t->flags = flags;
+	return e_ctl(EPOLL_CTL_MOD, t);
+}
+
+int libe_set_wrfn(int fd, void (*fn)(int fd, void *))
+{
+	struct event *t = e_lookup(fd);
 
-	t_add(t, &s.events);
-	if (s.epfd >= 0) {
-		struct epoll_event evdat = {
-			.events = EPOLLIN,
-			.data.ptr = t,
-		};
+	if (!t) {
+		errno = ENOENT;
+		return -1;
+	}
+	t->wrfn = fn;
+	return 0;
+}
 
-		return epoll_ctl(s.epfd, EPOLL_CTL_ADD, fd, &evdat);
+int libe_set_prio(int fd, int prio)
+{
+	struct event *t = e_lookup(fd);
+
+	if (!t) {
+		errno = ENOENT;
+		return -1;
+	}
+	if ((prio < 0) || (prio >= LIBE_NPRIO)) {
+		errno = EINVAL;
+		return -1;
 	}
+	t->prio = prio;
 	return 0;
 }
 
 void libe_remove_fd(int fd)
 {
-	struct event *t;
-	int j;
+	struct event *t = e_lookup(fd);
 
-	for (t = s.events; t; t = t->next) {
-		if (t->fd == fd)
-			break;
+	if (!t)
+		return;
+	/* pending events of this fd are ignored on generation mismatch */
+	s->fds[fd] = NULL;
+	e_ctl(EPOLL_CTL_DEL, t);
+	free(t);
+}
+
+/* queued I/O */
+int libe_pread(int fd, void *buf, int len, long offset,
+		void (*done)(int ret, void *dat), const void *dat)
+{
+	int ret;
+#ifdef USE_IO_URING
+	struct io_uring_sqe *sqe;
+	struct ioreq *req;
+
+	e_start();
+	if (s->u.fd >= 0) {
+		req = u_new_req(0, done, dat);
+		sqe = u_get_sqe();
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = fd;
+		sqe->addr = (uintptr_t)buf;
+		sqe->len = len;
+		sqe->off = offset;
+		sqe->user_data = U_REQ | (uintptr_t)req;
+		return 0;
 	}
-	if (t) {
-		/* alert? */
-		t_del(t);
-		free(t);
-		for (j = 0; j < s.nevs; ++j) {
-			if (s.evs[j].data.ptr == t)
-				/* clear this entry */
-				s.evs[j].data.ptr = NULL;
-		}
+#endif
+	++s->nsyscalls;
+	ret = pread(fd, buf, len, offset);
+	if (done)
+		done((ret < 0) ? -errno : ret, (void *)dat);
+	return 0;
+}
+
+int libe_sendto(int fd, const void *buf, int len,
+		const struct sockaddr *name, int namelen,
+		void (*done)(int ret, void *dat), const void *dat)
+{
+	int ret;
+#ifdef USE_IO_URING
+	struct io_uring_sqe *sqe;
+	struct ioreq *req;
+
+	e_start();
+	if ((s->u.fd >= 0) && (namelen <= sizeof(req->name))) {
+		req = u_new_req(len, done, dat);
+		memcpy(req->buf, buf, len);
+		if (name)
+			memcpy(&req->name, name, namelen);
+		req->iov.iov_base = req->buf;
+		req->iov.iov_len = len;
+		req->msg.msg_name = name ? &req->name : NULL;
+		req->msg.msg_namelen = namelen;
+		req->msg.msg_iov = &req->iov;
+		req->msg.msg_iovlen = 1;
+		sqe = u_get_sqe();
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->fd = fd;
+		sqe->addr = (uintptr_t)&req->msg;
+		sqe->len = 1;
+		/* report a full socket, rather than waiting for it */
+		sqe->msg_flags = MSG_DONTWAIT;
+		sqe->user_data = U_REQ | (uintptr_t)req;
+		return 0;
 	}
-	if (s.epfd >= 0)
-		epoll_ctl(s.epfd, EPOLL_CTL_DEL, fd, 0);
+#endif
+	++s->nsyscalls;
+	ret = sendto(fd, buf, len, MSG_DONTWAIT, name, namelen);
+	if (done)
+		done((ret < 0) ? -errno : ret, (void *)dat);
+	return 0;
 }
 
 /* main run */
 int libe_wait(int waitmsec)
 {
 	int ret;
-	struct event *t;
 
-	if (s.epfd < 0) {
-		/* start EPOLL */
-		struct epoll_event evdat = {
-			.events = EPOLLIN,
-		};
-
-		ret = s.epfd = epoll_create(NEVS);
-		if (ret < 0)
-			return ret;
-		for (t = s.events; t; t = t->next) {
-			evdat.data.ptr = t;
-			ret = epoll_ctl(s.epfd, EPOLL_CTL_ADD, t->fd, &evdat);
-			if (ret < 0) {
-				close(s.epfd);
-				s.epfd = -1;
-				return ret;
-			}
-		}
+	ret = e_start();
+	if (ret < 0)
+		return ret;
+	if (!s->sevs || (s->full && (s->sevs < MAXNEVS))) {
+		/* the last batch filled the event array, grow it */
+		s->sevs = s->sevs ? s->sevs*2 : NEVS;
+		free(s->evs);
+		s->evs = malloc(sizeof(*s->evs)*s->sevs);
 	}
 
-	ret = epoll_wait(s.epfd, s.evs, NEVS, waitmsec);
-	s.nevs = (ret >= 0) ? ret : 0;
+#ifdef USE_IO_URING
+	if (s->u.fd >= 0) {
+		ret = u_wait(waitmsec);
+		s->waketime = e_now();
+		return ret;
+	}
+#endif
+	++s->nsyscalls;
+	ret = epoll_wait(s->epfd, s->evs, s->sevs, waitmsec);
+	s->nevs = (ret >= 0) ? ret : 0;
+	s->full = (s->nevs == s->sevs);
+	s->waketime = e_now();
 	return ret;
 }
 
-void libe_flush(void)
+/* lookup the event of a epoll result, NULL when removed meanwhile */
+static struct event *e_lookup_ev(const struct epoll_event *ev)
+{
+	struct event *t = e_lookup((uint32_t)ev->data.u64);
+
+	if (!t || (t->gen != (uint32_t)(ev->data.u64 >> 32)))
+		return NULL;
+	return t;
+}
+
+/* epoll, or io_uring without provided buffers */
+static void e_recv_drain(struct event *t)
+{
+	char buf[LIBE_RECVSIZE];
+	struct sockaddr_storage name;
+	socklen_t namelen;
+	uint32_t gen = t->gen;
+	int fd = t->fd, ret;
+
+	for (;;) {
+		namelen = sizeof(name);
+		++s->nsyscalls;
+		ret = recvfrom(fd, buf, sizeof(buf), MSG_DONTWAIT,
+				(struct sockaddr *)&name, &namelen);
+		if ((ret < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+			return;
+		t->recvfn(fd, buf, (ret < 0) ? -errno : ret,
+				(struct sockaddr *)&name, namelen, t->dat);
+		/* the handler may have removed <fd> */
+		t = e_lookup(fd);
+		if ((ret < 0) || !t || (t->gen != gen))
+			return;
+	}
+}
+
+void libe_flush_prio(int prio)
 {
 	int j;
+	uint32_t events;
 	struct event *t;
+	double delay;
+#ifdef USE_IO_URING
+	struct urecv *r;
 
-	for (j = 0; j < s.nevs; ++j) {
-		if (!s.evs[j].data.ptr)
-			// cleared by evt_remove
+	for (j = 0; j < s->u.nrecvs; ++j) {
+		r = &s->u.recvs[j];
+		if (r->done)
 			continue;
-		t = s.evs[j].data.ptr;
-		t->fn(t->fd, t->dat);
+		t = e_lookup((uint32_t)r->data);
+		if (t && (t->gen != (uint32_t)(r->data >> 32)))
+			t = NULL;
+		if (t && (t->prio != prio))
+			continue;
+		r->done = 1;
+		if (t)
+			u_recv_dispatch(t, r);
+		if (r->bid >= 0)
+			u_buf_return(r->bid);
+	}
+#endif
+
+	for (j = 0; j < s->nevs; ++j) {
+		t = e_lookup_ev(&s->evs[j]);
+		if (!t)
+			/* removed during this flush */
+			continue;
+		events = s->evs[j].events;
+		if (!events || (t->prio != prio))
+			continue;
+		/* dispatched */
+		s->evs[j].events = 0;
+		delay = e_now() - s->waketime;
+		++s->lat[prio].n;
+		s->lat[prio].sum += delay;
+		if (delay > s->lat[prio].max)
+			s->lat[prio].max = delay;
+		/* errors & hangups go to the regular handler */
+		if ((events & ~EPOLLOUT) && t->recvfn)
+			e_recv_drain(t);
+		else if (events & ~EPOLLOUT)
+			t->fn(t->fd, t->dat);
+		if (!(events & EPOLLOUT))
+			continue;
+		t = e_lookup_ev(&s->evs[j]);
+		if (t && t->wrfn && (t->flags & LIBE_WR))
+			t->wrfn(t->fd, t->dat);
+	}
+}
+
+void libe_flush(void)
+{
+	int prio;
+#ifdef USE_IO_URING
+	struct ioreq *req;
+#endif
+
+	for (prio = 0; prio < LIBE_NPRIO; ++prio)
+		libe_flush_prio(prio);
+	s->nevs = 0;
+#ifdef USE_IO_URING
+	/* all received datagrams have been dispatched */
+	s->u.nrecvs = 0;
+	while (s->u.cplt) {
+		req = s->u.cplt;
+		s->u.cplt = req->next;
+		if (!s->u.cplt)
+			s->u.cpltlast = NULL;
+		req->done(req->ret, req->dat);
+		free(req);
 	}
-	s.nevs = 0;
+#endif
+}
+
+double libe_latency(int prio, double *pmax)
+{
+	double avg;
+
+	if ((prio < 0) || (prio >= LIBE_NPRIO))
+		return NAN;
+	avg = s->lat[prio].n ? s->lat[prio].sum / s->lat[prio].n : 0;
+	if (pmax)
+		*pmax = s->lat[prio].max;
+	s->lat[prio].n = 0;
+	s->lat[prio].sum = s->lat[prio].max = 0;
+	return avg;
+}
+
+const char *libe_backend(void)
+{
+#ifdef USE_IO_URING
+	if (s->u.fd >= 0)
+		return "io_uring";
+#endif
+	return (s->epfd >= 0) ? "epoll" : NULL;
+}
+
+unsigned long libe_nsyscalls(void)
+{
+	return s->nsyscalls;
 }
 
 /* cleanup storage */
 __attribute__((destructor))
 void libe_cleanup(void)
 {
-	struct event *t;
+	int fd;
 
-	while (s.events) {
-		t = s.events;
-		s.events = t->next;
-		free(t);
+	for (fd = 0; fd < s->nfds; ++fd) {
+		if (s->fds[fd])
+			free(s->fds[fd]);
 	}
-	if (s.epfd >= 0)
-		close(s.epfd);
+	free(s->fds);
+	s->fds = NULL;
+	s->nfds = 0;
+	free(s->evs);
+	s->evs = NULL;
+	s->sevs = s->nevs = s->full = 0;
+#ifdef USE_IO_URING
+	u_cleanup();
+#endif
+	if (s->epfd >= 0)
+		close(s->epfd);
+	s->epfd = -1;
+}
+
+/* contexts */
+struct libe *libe_new(void)
+{
+	static const struct libe init = LIBE_INIT;
+	struct libe *ctx;
+
+	ctx = malloc(sizeof(*ctx));
+	/* don't test, see libe_add_fd */
+	*ctx = init;
+	return ctx;
+}
+
+struct libe *libe_use(struct libe *ctx)
+{
+	struct libe *prev = s;
+
+	s = ctx ?: &defctx;
+	return prev;
+}
+
+void libe_free(struct libe *ctx)
+{
+	struct libe *prev;
+
+	if (!ctx)
+		return;
+	prev = libe_use(ctx);
+	libe_cleanup();
+	libe_use((prev == ctx) ? NULL : prev);
+	if (ctx != &defctx)
+		free(ctx);
 }
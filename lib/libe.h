@@ -25,6 +25,65 @@ extern "C" {
 /* watch for events on <fd> */
 extern int libe_add_fd(int fd, void (*fn)(int fd, void *), const void *dat);
 
+/* event flags */
+#define LIBE_RD		0x01 /* wait for readable */
+#define LIBE_WR		0x02 /* wait for writable, see libe_set_wrfn() */
+#define LIBE_PRI	0x04 /* wait for priority data, like sysfs_notify() */
+#define LIBE_ET		0x10 /* edge-triggered, the handler must drain <fd> */
+
+/* change the event flags of a watched <fd>, LIBE_RD is the default */
+extern int libe_mod_fd(int fd, int flags);
+
+/* set the handler for a writable <fd>, it receives the same <dat>
+ * Enable it with LIBE_WR, only while there is something to write.
+ */
+extern int libe_set_wrfn(int fd, void (*fn)(int fd, void *));
+
+struct sockaddr;
+
+/* receive datagrams from the non-blocking socket <fd>
+ * <fn> is called for each datagram, with its sender <name>,
+ * or with a negative <len> that holds -errno.
+ * Datagrams are truncated to LIBE_RECVSIZE bytes.
+ * io_uring receives into provided buffers, without syscalls,
+ * otherwise libe calls recvfrom() until <fd> is drained.
+ * Received datagrams that were not yet dispatched when <fd> is
+ * removed, are dropped.
+ * Use this instead of libe_add_fd(), libe_mod_fd() etc. still apply.
+ */
+#define LIBE_RECVSIZE	2048
+extern int libe_add_recv(int fd, void (*fn)(int fd, const void *buf, int len,
+			const struct sockaddr *name, int namelen, void *dat),
+		const void *dat);
+
+/* queued I/O
+ * io_uring queues the request. The next libe_wait submits it, together
+ * with the others of this loop and the wait, in 1 syscall.
+ * <done> is called from libe_flush with the number of bytes or -errno.
+ * epoll does the I/O immediately, and calls <done> before returning.
+ * <done> may be NULL.
+ */
+/* read <len> bytes at <offset> into <buf>, which must remain valid
+ * until <done> is called
+ */
+extern int libe_pread(int fd, void *buf, int len, long offset,
+		void (*done)(int ret, void *dat), const void *dat);
+/* send a datagram without blocking, libe copies <buf> and <name> */
+extern int libe_sendto(int fd, const void *buf, int len,
+		const struct sockaddr *name, int namelen,
+		void (*done)(int ret, void *dat), const void *dat);
+
+/* priority classes
+ * libe_flush dispatches the ready fds of higher classes first
+ */
+#define LIBE_PRIO_HIGH		0 /* latency-critical, like input devices */
+#define LIBE_PRIO_NORMAL	1 /* the default */
+#define LIBE_PRIO_LOW		2 /* bulk work */
+#define LIBE_NPRIO		3
+
+/* set the priority class of a watched <fd> */
+extern int libe_set_prio(int fd, int prio);
+
 /* remove a watched <fd>
  * Nothing happens when no matching timeout is found
  */
@@ -38,11 +97,45 @@ extern int libe_wait(int waitmsec);
  */
 extern void libe_flush(void);
 
+/* handle the queued events of 1 priority class only
+ * libe_flush() skips those events later on.
+ */
+extern void libe_flush_prio(int prio);
+
+/* average delay between libe_wait returning and dispatching a handler
+ * of class <prio>, in seconds, since the previous call.
+ * <pmax> receives the maximum delay.
+ */
+extern double libe_latency(int prio, double *pmax);
+
+/* name of the backend in use: "epoll", "io_uring", or NULL before libe_wait
+ * io_uring is used when compiled with USE_IO_URING, and not
+ * refused by the kernel, or by the LIBE_BACKEND environment variable
+ */
+extern const char *libe_backend(void);
+
+/* number of syscalls done by libe, for benchmarking */
+extern unsigned long libe_nsyscalls(void);
+
 /* cleanup, called automatically on exit also
  * May be called twice.
  */
 extern void libe_cleanup(void);
 
+/* event loop contexts
+ * All functions above operate on the current context of the calling
+ * thread. That is a process-wide default, until libe_use()
+ * selects another one. An fd is watched by 1 context only.
+ */
+struct libe;
+extern struct libe *libe_new(void);
+/* free a context, with its registrations */
+extern void libe_free(struct libe *ctx);
+/* make <ctx> current for this thread, NULL selects the default
+ * returns the previous context
+ */
+extern struct libe *libe_use(struct libe *ctx);
+
 #ifdef __cplusplus
 }
 #endif
@@ -17,89 +17,314 @@
  * along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <errno.h>
+
+#include <unistd.h>
+#if !defined(USE_GETTIMEOFDAY) && !defined(NO_TIMERFD)
+#include <sys/timerfd.h>
+#define HAVE_TIMERFD
+#endif
 
 #include "libt.h"
 
-struct timer {
-	struct timer *next, *prev;
+struct libt_timer {
 	void (*fn)(void *dat);
 	void *dat;
 	double wakeup;
+	/* tolerated delay after @wakeup, to coalesce wakeups */
+	double slack;
+	/* insertion sequence, keeps equal wakeups in FIFO order */
+	unsigned long seq;
+	/* priority class, selects the heap */
+	int prio;
+	/* position in its heap, -1 when not scheduled */
+	int hidx;
+	int flags;
+		#define TF_HASHED	0x01 /* created by the (fn, dat) API */
+		#define TF_EXPIRED	0x02 /* member of s->expired */
+	/* (fn, dat) hash chain */
+	struct libt_timer *hnext;
+	/* expired timers, during libt_flush */
+	struct libt_timer *enext;
+};
+
+/* binary min-heap of scheduled timers */
+struct theap {
+	struct libt_timer **heap;
+	int nheap, sheap;
+	/* upper bound of the slack of its timers */
+	double maxslack;
 };
 
-static struct {
-	struct timer *timers;
-	struct timer *tmptimers;
-} s;
+struct libt {
+	/* 1 heap per priority class */
+	struct theap h[LIBT_NPRIO];
+	unsigned long seq;
+	/* (fn, dat) index, for the compatibility API */
+	struct libt_timer **hash;
+	int nhash, shash;
+	/* timers that expired during libt_flush, for possible re-arm */
+	struct libt_timer *expired;
+	int inflush;
+	/* timerfd, armed for the earliest wakeup */
+	int tfd;
+	double tfdwakeup;
+	/* lateness of timers, per priority class */
+	struct {
+		unsigned long n;
+		double sum, max;
+	} lat[LIBT_NPRIO];
+};
 
-/* double-linked-list black magic:
- * The @prev member of the first element points to a 'fake' element
- * which is well-crafted so that assigning prev->next just happens
- * to set the root pointer
- * This function return the required 'fake' pointers
- */
-static inline struct timer *t_fakeelement(struct timer **root)
+#define LIBT_INIT	{ .tfd = -1, }
+static struct libt defctx = LIBT_INIT;
+/* current context of this thread */
+static __thread struct libt *s = &defctx;
+
+/* latest allowed wakeup */
+static inline double t_deadline(const struct libt_timer *t)
+{
+	return t->wakeup + t->slack;
+}
+
+/* earliest timer of all priority classes */
+static struct libt_timer *t_first(void)
 {
-	return (struct timer *)(((char *)root) - offsetof(struct timer, next));
+	struct libt_timer *first = NULL, *t;
+	int prio;
 
+	for (prio = 0; prio < LIBT_NPRIO; ++prio) {
+		if (!s->h[prio].nheap)
+			continue;
+		t = s->h[prio].heap[0];
+		if (!first || (t_deadline(t) < t_deadline(first)))
+			first = t;
+	}
+	return first;
 }
 
-/* double linked list */
-static void t_del(struct timer *t)
+/* timerfd */
+static void t_sync_timerfd(void)
 {
-	if (t->next)
-		t->next->prev = t->prev;
-	if (t->prev)
-		t->prev->next = t->next;
-	t->next = t->prev = NULL;
+#ifdef HAVE_TIMERFD
+	struct itimerspec it = {};
+	struct libt_timer *first;
+	double wakeup;
+
+	if ((s->tfd < 0) || s->inflush)
+		return;
+	first = t_first();
+	wakeup = first ? t_deadline(first) : 0;
+	if (wakeup == s->tfdwakeup)
+		return;
+	/* a zero it_value disarms the timerfd */
+	it.it_value.tv_sec = floor(wakeup);
+	it.it_value.tv_nsec = (wakeup - floor(wakeup)) * 1e9;
+	if (wakeup && !it.it_value.tv_sec && !it.it_value.tv_nsec)
+		it.it_value.tv_nsec = 1;
+	if (timerfd_settime(s->tfd, TFD_TIMER_ABSTIME, &it, NULL) >= 0)
+		s->tfdwakeup = wakeup;
+#endif
 }
 
-static void t_add(struct timer *t, struct timer **root)
+/* binary heap, sorted on the latest allowed wakeup */
+static inline int t_before(const struct libt_timer *a, const struct libt_timer *b)
 {
-	t_del(t);
-	t->next = *root;
-	if (t->next) {
-		t->prev = t->next->prev;
-		t->next->prev = t;
-	} else
-		/* this is dirty: fake a timer struct, which will only be used
-		 * for setting the @next member
-		 */
-		t->prev = t_fakeelement(root);
-	t->prev->next = t;
+	if (t_deadline(a) != t_deadline(b))
+		return t_deadline(a) < t_deadline(b);
+	return a->seq < b->seq;
 }
 
-static void t_add_sorted(struct timer *t, struct timer **root)
+static inline void t_heapset(struct theap *h, int idx, struct libt_timer *t)
 {
+	h->heap[idx] = t;
+	t->hidx = idx;
+}
+
+static void t_siftup(struct theap *h, int idx)
+{
+	struct libt_timer *t = h->heap[idx];
+	int parent;
+
+	for (; idx > 0; idx = parent) {
+		parent = (idx - 1) / 2;
+		if (!t_before(t, h->heap[parent]))
+			break;
+		t_heapset(h, idx, h->heap[parent]);
+	}
+	t_heapset(h, idx, t);
+}
+
+static void t_siftdown(struct theap *h, int idx)
+{
+	struct libt_timer *t = h->heap[idx];
+	int child;
+
+	for (;; idx = child) {
+		child = idx*2 + 1;
+		if (child >= h->nheap)
+			break;
+		if ((child + 1 < h->nheap) && t_before(h->heap[child+1], h->heap[child]))
+			++child;
+		if (!t_before(h->heap[child], t))
+			break;
+		t_heapset(h, idx, h->heap[child]);
+	}
+	t_heapset(h, idx, t);
+}
+
+static void t_del(struct libt_timer *t)
+{
+	struct theap *h = &s->h[t->prio];
+	int idx = t->hidx;
+	struct libt_timer *last;
+
+	if (idx < 0)
+		return;
+	t->hidx = -1;
+	last = h->heap[--h->nheap];
+	if (!h->nheap)
+		h->maxslack = 0;
+	if (last != t) {
+		t_heapset(h, idx, last);
+		if ((idx > 0) && t_before(last, h->heap[(idx - 1) / 2]))
+			t_siftup(h, idx);
+		else
+			t_siftdown(h, idx);
+	}
+	if (!idx)
+		t_sync_timerfd();
+}
+
+/* (re)insert @t, after its wakeup has been modified */
+static void t_add_sorted(struct libt_timer *t)
+{
+	struct theap *h = &s->h[t->prio];
+
 	t_del(t);
-	/* iterate root until all smaller items have passed */
-	for (; *root; root = &(*root)->next) {
-		if (t->wakeup < (*root)->wakeup)
+	if (h->nheap >= h->sheap) {
+		h->sheap = h->sheap ? h->sheap*2 : 16;
+		h->heap = realloc(h->heap, sizeof(*h->heap)*h->sheap);
+		/* don't test for NULL, see libt_add_timeout */
+	}
+	t->seq = s->seq++;
+	if (t->slack > h->maxslack)
+		h->maxslack = t->slack;
+	t_heapset(h, h->nheap++, t);
+	t_siftup(h, t->hidx);
+	if (!t->hidx)
+		t_sync_timerfd();
+}
+
+/* (fn, dat) hash index */
+static inline unsigned int t_hashval(void (*fn)(void *), const void *dat)
+{
+	uintptr_t h = (uintptr_t)fn ^ ((uintptr_t)dat * 31);
+
+	h ^= h >> 16;
+	h *= 0x45d9f3b;
+	h ^= h >> 16;
+	return h & (s->shash - 1);
+}
+
+static void t_hash_grow(void)
+{
+	struct libt_timer **old = s->hash, *t;
+	int j, oldsize = s->shash;
+
+	s->shash = s->shash ? s->shash*2 : 64;
+	s->hash = calloc(s->shash, sizeof(*s->hash));
+	for (j = 0; j < oldsize; ++j) {
+		while (old[j]) {
+			t = old[j];
+			old[j] = t->hnext;
+			t->hnext = s->hash[t_hashval(t->fn, t->dat)];
+			s->hash[t_hashval(t->fn, t->dat)] = t;
+		}
+	}
+	free(old);
+}
+
+static void t_hash_add(struct libt_timer *t)
+{
+	unsigned int h;
+
+	if (s->nhash >= s->shash)
+		t_hash_grow();
+	h = t_hashval(t->fn, t->dat);
+	t->hnext = s->hash[h];
+	s->hash[h] = t;
+	t->flags |= TF_HASHED;
+	++s->nhash;
+}
+
+static void t_hash_del(struct libt_timer *t)
+{
+	struct libt_timer **pt;
+
+	if (!(t->flags & TF_HASHED))
+		return;
+	for (pt = &s->hash[t_hashval(t->fn, t->dat)]; *pt; pt = &(*pt)->hnext) {
+		if (*pt == t) {
+			*pt = t->hnext;
 			break;
+		}
 	}
-	t_add(t, root);
+	t->flags &= ~TF_HASHED;
+	--s->nhash;
 }
 
 /* local/private tools */
-static struct timer *t_find(void (*fn)(void *), const void *dat)
+static struct libt_timer *t_find(void (*fn)(void *), const void *dat)
 {
-	struct timer *t;
+	struct libt_timer *t;
 
-	for (t = s.timers; t; t = t->next) {
-		if ((t->fn == fn) && (t->dat == dat))
-			return t;
-	}
-	for (t = s.tmptimers; t; t = t->next) {
+	if (!s->nhash)
+		return NULL;
+	for (t = s->hash[t_hashval(fn, dat)]; t; t = t->hnext) {
 		if ((t->fn == fn) && (t->dat == dat))
 			return t;
 	}
 	return NULL;
 }
 
+static struct libt_timer *t_new(void (*fn)(void *), const void *dat)
+{
+	struct libt_timer *t;
+
+	t = malloc(sizeof(*t));
+	/* don't test t since I don't know what to do if it was NULL
+	 * So, I just use it, and maybe we segfault, which is the best
+	 * I can imagine in that case
+	 */
+	memset(t, 0, sizeof(*t));
+	t->fn = fn;
+	t->dat = (void *)dat;
+	t->prio = LIBT_PRIO_NORMAL;
+	t->hidx = -1;
+	return t;
+}
+
+static void t_repeat(struct libt_timer *t, double increment)
+{
+	double now = libt_now();
+
+	t->wakeup += increment;
+	if (t->wakeup < now)
+		/* We're scheduling in the past.
+		 * Jump to the future again,
+		 * make 'repeat' fail in maintaining strict timing
+		 * and mimic 'add' behaviour
+		 */
+		t->wakeup = now + increment;
+	t_add_sorted(t);
+}
+
 /* exported API */
 double libt_now(void)
 {
@@ -116,59 +341,65 @@ double libt_now(void)
 #endif
 }
 
-void libt_add_timeout(double timeout, void (*fn)(void *), const void *dat)
+void libt_add_timeout_prio(double timeout, double slack, int prio,
+		void (*fn)(void *), const void *dat)
 {
-	struct timer *t;
+	struct libt_timer *t;
 
 	if (isnan(timeout))
 		return;
 	t = t_find(fn, dat);
 	if (!t) {
-		t = malloc(sizeof(*t));
-		/* don't test t since I don't know what to do if it was NULL
-		 * So, I just use it, and maybe we segfault, which is the best
-		 * I can imagine in that case
-		 */
-		memset(t, 0, sizeof(*t));
-		t->fn = fn;
-		t->dat = (void *)dat;
+		t = t_new(fn, dat);
+		t_hash_add(t);
+	}
+	if ((prio < 0) || (prio >= LIBT_NPRIO))
+		prio = LIBT_PRIO_NORMAL;
+	if (prio != t->prio) {
+		/* move to the other heap */
+		t_del(t);
+		t->prio = prio;
 	}
 	t->wakeup = libt_now() + timeout;
-	t_add_sorted(t, &s.timers);
+	t->slack = (slack > 0) ? slack : 0;
+	t_add_sorted(t);
+}
+
+void libt_add_timeout_slack(double timeout, double slack,
+		void (*fn)(void *), const void *dat)
+{
+	libt_add_timeout_prio(timeout, slack, LIBT_PRIO_NORMAL, fn, dat);
+}
+
+void libt_add_timeout(double timeout, void (*fn)(void *), const void *dat)
+{
+	libt_add_timeout_slack(timeout, 0, fn, dat);
 }
 
 void libt_repeat_timeout(double increment, void (*fn)(void *), const void *dat)
 {
-	struct timer *t;
+	struct libt_timer *t;
 
 	if (isnan(increment))
 		return;
 	t = t_find(fn, dat);
 	if (!t)
 		libt_add_timeout(increment, fn, dat);
-	else {
-		double now = libt_now();
-
-		t->wakeup += increment;
-		if (t->wakeup < now)
-			/* We're scheduling in the past.
-			 * Jump to the future again,
-			 * make 'repeat' fail in maintaining strict timing
-			 * and mimic 'add' behaviour
-			 */
-			t->wakeup = now + increment;
-		t_add_sorted(t, &s.timers);
-	}
+	else
+		t_repeat(t, increment);
 }
 
 void libt_remove_timeout(void (*fn)(void *), const void *dat)
 {
-	struct timer *t;
+	struct libt_timer *t;
 
 	t = t_find(fn, dat);
 	if (t) {
 		t_del(t);
-		free(t);
+		t_hash_del(t);
+		if (!(t->flags & TF_EXPIRED))
+			free(t);
+		/* else: libt_flush will free it */
 	}
 }
 
@@ -177,45 +408,187 @@ int libt_timeout_exist(void (*fn)(void *), const void *dat)
 	return !!t_find(fn, dat);
 }
 
-int libt_flush(void)
+/* handle API */
+struct libt_timer *libt_timer_new(void (*fn)(void *), const void *dat)
 {
-	struct timer *t;
-	double now;
-	int cnt;
+	return t_new(fn, dat);
+}
 
-	now = libt_now() +0.001;
-	cnt = 0;
-	while (s.timers) {
-		t = s.timers;
-		if (t->wakeup > now)
-			break;
-		/*
-		 * move tries to garbage, for possible re-arm inside
-		 * the timer callback
-		 */
-		t_add(t, &s.tmptimers);
+void libt_timer_free(struct libt_timer *t)
+{
+	if (!t)
+		return;
+	t_del(t);
+	free(t);
+}
+
+void libt_timer_add(struct libt_timer *t, double timeout)
+{
+	if (isnan(timeout))
+		return;
+	t->wakeup = libt_now() + timeout;
+	t_add_sorted(t);
+}
+
+void libt_timer_repeat(struct libt_timer *t, double increment)
+{
+	if (isnan(increment))
+		return;
+	t_repeat(t, increment);
+}
+
+void libt_timer_cancel(struct libt_timer *t)
+{
+	t_del(t);
+}
+
+void libt_timer_set_slack(struct libt_timer *t, double slack)
+{
+	t->slack = (slack > 0) ? slack : 0;
+	if (t->hidx >= 0)
+		t_add_sorted(t);
+}
+
+void libt_timer_set_prio(struct libt_timer *t, int prio)
+{
+	int pending = t->hidx >= 0;
+
+	if ((prio < 0) || (prio >= LIBT_NPRIO) || (prio == t->prio))
+		return;
+	t_del(t);
+	t->prio = prio;
+	if (pending)
+		t_add_sorted(t);
+}
+
+int libt_timer_pending(const struct libt_timer *t)
+{
+	return t->hidx >= 0;
+}
+
+/*
+ * find a timer in the subtree at @idx that reached its wakeup at @now
+ * Wakeups below a node are not earlier than its deadline - maxslack,
+ * which limits the walk to the part of the heap that can be due.
+ */
+static struct libt_timer *t_find_due(struct theap *h, int idx, double now)
+{
+	struct libt_timer *t;
+
+	if (idx >= h->nheap)
+		return NULL;
+	t = h->heap[idx];
+	if (t_deadline(t) - h->maxslack > now)
+		return NULL;
+	if (t->wakeup <= now)
+		return t;
+	t = t_find_due(h, idx*2 + 1, now);
+	return t ? t : t_find_due(h, idx*2 + 2, now);
+}
+
+/* run expired timers of 1 class */
+static int t_run(int prio, double now)
+{
+	struct theap *h = &s->h[prio];
+	struct libt_timer *t;
+	double late;
+	int cnt = 0;
+
+	/*
+	 * Besides the root, which has the earliest deadline,
+	 * any timer that has reached its wakeup by now
+	 * is run too, saving a wakeup later.
+	 */
+	while ((t = t_find_due(h, 0, now)) != NULL) {
+		t_del(t);
+		if (t->flags & TF_HASHED) {
+			/*
+			 * keep (fn, dat) timers alive until the end,
+			 * for possible re-arm inside the timer callback
+			 */
+			t->flags |= TF_EXPIRED;
+			t->enext = s->expired;
+			s->expired = t;
+		}
+		late = libt_now() - t->wakeup;
+		if (late < 0)
+			late = 0;
+		++s->lat[prio].n;
+		s->lat[prio].sum += late;
+		if (late > s->lat[prio].max)
+			s->lat[prio].max = late;
 		t->fn(t->dat);
 		++cnt;
 	}
-	/* clean up cache */
-	while (s.tmptimers) {
-		t = s.tmptimers;
-		t_del(t);
-		free(t);
+	return cnt;
+}
+
+static int t_flush(int prio, int nprio)
+{
+	struct libt_timer *t;
+	double now;
+	int cnt;
+
+	/* the timerfd does not wake up early, poll() may */
+	now = libt_now() + ((s->tfd >= 0) ? 0 : 0.001);
+	cnt = 0;
+	++s->inflush;
+	for (; nprio; --nprio, ++prio)
+		cnt += t_run(prio, now);
+	/* clean up expired timers that were not re-armed */
+	while (s->expired) {
+		t = s->expired;
+		s->expired = t->enext;
+		t->flags &= ~TF_EXPIRED;
+		if (t->hidx < 0) {
+			t_hash_del(t);
+			free(t);
+		}
 	}
+	--s->inflush;
+	t_sync_timerfd();
 	return cnt;
 }
 
+int libt_flush(void)
+{
+	return t_flush(0, LIBT_NPRIO);
+}
+
+int libt_flush_prio(int prio)
+{
+	if ((prio < 0) || (prio >= LIBT_NPRIO))
+		return 0;
+	return t_flush(prio, 1);
+}
+
+double libt_latency(int prio, double *pmax)
+{
+	double avg;
+
+	if ((prio < 0) || (prio >= LIBT_NPRIO))
+		return NAN;
+	avg = s->lat[prio].n ? s->lat[prio].sum / s->lat[prio].n : 0;
+	if (pmax)
+		*pmax = s->lat[prio].max;
+	s->lat[prio].n = 0;
+	s->lat[prio].sum = s->lat[prio].max = 0;
+	return avg;
+}
+
 double libt_next_wakeup(void)
 {
-	return s.timers ? s.timers->wakeup : -1;
+	struct libt_timer *first = t_first();
+
+	return first ? t_deadline(first) : -1;
 }
 
 int libt_get_waittime(void)
 {
+	struct libt_timer *first = t_first();
 	double tmp;
 
-	if (!s.timers)
+	if (!first)
 		return -1;
 	/* avoid integer overflows and use double
 	 * An integer overflow may result into a negative
@@ -224,7 +597,7 @@ int libt_get_waittime(void)
 	 * libt_get_waittime() for poll() runs away with the cpu
 	 * because the waittime is wrong.
 	 */
-	tmp = (s.timers->wakeup - libt_now()) * 1000;
+	tmp = (t_deadline(first) - libt_now()) * 1000;
 	/* compute the max result value that we want to return.
 	 * This is 1/4 of the maximum int value
 	 */
@@ -237,20 +610,90 @@ int libt_get_waittime(void)
 		return tmp;
 }
 
+int libt_timerfd(void)
+{
+#ifdef HAVE_TIMERFD
+	if (s->tfd >= 0)
+		return s->tfd;
+	s->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (s->tfd < 0)
+		return -1;
+	s->tfdwakeup = 0;
+	t_sync_timerfd();
+	return s->tfd;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
 /* cleanup storage */
 __attribute__((destructor))
 void libt_cleanup(void)
 {
-	struct timer *t;
+	struct libt_timer *t;
+	int j;
 
-	while (s.timers) {
-		t = s.timers;
-		s.timers = t->next;
-		free(t);
+	/* handle timers belong to their owner, only unschedule those */
+	for (j = 0; j < LIBT_NPRIO; ++j) {
+		while (s->h[j].nheap) {
+			t = s->h[j].heap[--s->h[j].nheap];
+			t->hidx = -1;
+		}
+		free(s->h[j].heap);
+		s->h[j].heap = NULL;
+		s->h[j].sheap = 0;
+	}
+	while (s->expired) {
+		t = s->expired;
+		s->expired = t->enext;
+		t->flags &= ~TF_EXPIRED;
 	}
-	while (s.tmptimers) {
-		t = s.tmptimers;
-		s.tmptimers = t->next;
-		free(t);
+	for (j = 0; j < s->shash; ++j) {
+		while (s->hash[j]) {
+			t = s->hash[j];
+			s->hash[j] = t->hnext;
+			free(t);
+		}
 	}
+	s->nhash = 0;
+	free(s->hash);
+	s->hash = NULL;
+	s->shash = 0;
+	if (s->tfd >= 0)
+		close(s->tfd);
+	s->tfd = -1;
+}
+
+/* contexts */
+struct libt *libt_new(void)
+{
+	static const struct libt init = LIBT_INIT;
+	struct libt *ctx;
+
+	ctx = malloc(sizeof(*ctx));
+	/* don't test, see t_new */
+	*ctx = init;
+	return ctx;
+}
+
+struct libt *libt_use(struct libt *ctx)
+{
+	struct libt *prev = s;
+
+	s = ctx ?: &defctx;
+	return prev;
+}
+
+void libt_free(struct libt *ctx)
+{
+	struct libt *prev;
+
+	if (!ctx)
+		return;
+	prev = libt_use(ctx);
+	libt_cleanup();
+	libt_use((prev == ctx) ? NULL : prev);
+	if (ctx != &defctx)
+		free(ctx);
 }
@@ -28,6 +28,30 @@ extern double libt_now(void);
 /* schedule a timeout @timerout seconds in the future */
 extern void libt_add_timeout(double timeout, void (*fn)(void *), const void *dat);
 
+/* schedule a timeout @timeout seconds in the future,
+ * that may be delayed up to @slack seconds.
+ * libt uses the slack to run several timeouts with one wakeup.
+ * libt_repeat_timeout() preserves the slack,
+ * libt_add_timeout() resets it.
+ */
+extern void libt_add_timeout_slack(double timeout, double slack,
+		void (*fn)(void *), const void *dat);
+
+/* priority classes
+ * libt_flush runs the expired timers of higher classes first
+ */
+#define LIBT_PRIO_HIGH		0 /* latency-critical */
+#define LIBT_PRIO_NORMAL	1 /* the default */
+#define LIBT_PRIO_LOW		2 /* bulk work */
+#define LIBT_NPRIO		3
+
+/* schedule a timeout with slack, in priority class @prio
+ * Like the slack, libt_repeat_timeout() preserves the class,
+ * and the other calls reset it.
+ */
+extern void libt_add_timeout_prio(double timeout, double slack, int prio,
+		void (*fn)(void *), const void *dat);
+
 /* repeat a previously scheduled timeout, @increment seconds further
  * When no matching scheduled timeout is found, this is identical to
  * libt_add_timeout()
@@ -45,10 +69,42 @@ extern void libt_remove_timeout(void (*fn)(void *), const void *dat);
  */
 extern int libt_timeout_exist(void (*fn)(void *), const void *dat);
 
+/* timer handles
+ * A handle avoids the (fn, dat) lookup and belongs to the caller:
+ * it remains valid after it expired, until libt_timer_free().
+ */
+struct libt_timer;
+
+extern struct libt_timer *libt_timer_new(void (*fn)(void *), const void *dat);
+extern void libt_timer_free(struct libt_timer *t);
+/* schedule @t @timeout seconds in the future */
+extern void libt_timer_add(struct libt_timer *t, double timeout);
+/* reschedule @t @increment seconds after its previous wakeup */
+extern void libt_timer_repeat(struct libt_timer *t, double increment);
+/* allow @t to be delayed up to @slack seconds */
+extern void libt_timer_set_slack(struct libt_timer *t, double slack);
+/* put @t in priority class @prio */
+extern void libt_timer_set_prio(struct libt_timer *t, int prio);
+/* unschedule @t */
+extern void libt_timer_cancel(struct libt_timer *t);
+/* return true if @t is scheduled */
+extern int libt_timer_pending(const struct libt_timer *t);
+
 /* run callbacks for all timouts that have passed now */
 extern int libt_flush(void);
 
-/* retrieve earliest scheduled timeout, in absolute time like libt_now() */
+/* run callbacks for the passed timeouts of class @prio only */
+extern int libt_flush_prio(int prio);
+
+/* average delay between the wakeup and the callback of timers of
+ * class @prio, in seconds, since the previous call.
+ * @pmax receives the maximum delay.
+ */
+extern double libt_latency(int prio, double *pmax);
+
+/* retrieve earliest scheduled timeout, in absolute time like libt_now()
+ * This accounts for the slack of each timeout.
+ */
 extern double libt_next_wakeup(void);
 
 /* retrieve earliest scheduled timeout in msecs, in relative time
@@ -56,11 +112,33 @@ extern double libt_next_wakeup(void);
  */
 extern int libt_get_waittime(void);
 
+/* return a timerfd that becomes readable on the earliest scheduled timeout
+ * libt keeps it armed from then on, with nanosecond precision.
+ * The caller must read() it to clear the event, and still call libt_flush().
+ * Returns -1 when timerfd's are not available.
+ */
+extern int libt_timerfd(void);
+
 /* cleanup, called automatically on exit also
  * May be called twice.
  */
 extern void libt_cleanup(void);
 
+/* timer contexts
+ * All functions above operate on the current context of the calling
+ * thread. That is a process-wide default, until libt_use()
+ * selects another one. A timer handle must only be used while the
+ * context that was current at libt_timer_new() is current.
+ */
+struct libt;
+extern struct libt *libt_new(void);
+/* free a context, with its (fn, dat) timeouts */
+extern void libt_free(struct libt *ctx);
+/* make <ctx> current for this thread, NULL selects the default
+ * returns the previous context
+ */
+extern struct libt *libt_use(struct libt *ctx);
+
 #ifdef __cplusplus
 }
 #endif
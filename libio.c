@@ -4,20 +4,134 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <math.h>
+#include <stdint.h>
 
+#include <unistd.h>
 #include <glob.h>
+#include <signal.h>
 #include <sys/time.h>
+#include <sys/timerfd.h>
 
 #include "lib/libt.h"
 #include "lib/libe.h"
 #include "_libio.h"
 
+static void libio_timerfd(int fd, void *dat)
+{
+	uint64_t expirations;
+
+	/* clear the event, libio_wait runs the timers */
+	if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+		elog(LOG_ERR, errno, "read timerfd");
+}
+
+/* loop contexts */
+struct libio_loop {
+	struct libe *e;
+	struct libt *t;
+	int use_timerfd;
+	/* periodic polls, they use the timers of this loop */
+	struct pollgroup *pollgroups;
+	/* wakeup statistics */
+	unsigned long nwakeups, nwakeups_mark;
+	double wakeups_mark_time;
+};
+
+static struct libio_loop defloop;
+/* current loop of this thread */
+static __thread struct libio_loop *loop = &defloop;
+
+struct libio_loop *libio_loop_new(void)
+{
+	struct libio_loop *l;
+
+	l = zalloc(sizeof(*l));
+	l->e = libe_new();
+	l->t = libt_new();
+	return l;
+}
+
+struct libio_loop *libio_use_loop(struct libio_loop *l)
+{
+	struct libio_loop *prev = loop;
+
+	loop = l ?: &defloop;
+	libe_use(loop->e);
+	libt_use(loop->t);
+	return prev;
+}
+
+void libio_loop_free(struct libio_loop *l)
+{
+	if (!l || (l == &defloop))
+		return;
+	if (l == loop)
+		libio_use_loop(NULL);
+	free_pollgroups(l->pollgroups);
+	libe_free(l->e);
+	libt_free(l->t);
+	free(l);
+}
+
+struct pollgroup **libio_loop_pollgroups(void)
+{
+	return &loop->pollgroups;
+}
+
+double libio_wakeup_rate(void)
+{
+	double now = libt_now(), rate;
+
+	rate = (loop->nwakeups - loop->nwakeups_mark) / (now - loop->wakeups_mark_time);
+	loop->nwakeups_mark = loop->nwakeups;
+	loop->wakeups_mark_time = now;
+	return rate;
+}
+
+static void libio_report_wakeups(void *dat)
+{
+	static const char *const prionames[] = { "high", "normal", "low", };
+	double e, emax, t, tmax;
+	int prio;
+
+	elog(LOG_DEBUG, 0, "%.2lf wakeups/s", libio_wakeup_rate());
+	for (prio = 0; prio < LIBE_NPRIO; ++prio) {
+		e = libe_latency(prio, &emax);
+		t = libt_latency(prio, &tmax);
+		elog(LOG_DEBUG, 0, "%s latency: fd %.3lf/%.3lfms, timer %.3lf/%.3lfms",
+				prionames[prio], e*1e3, emax*1e3, t*1e3, tmax*1e3);
+	}
+	libt_add_timeout_slack(60, 10, libio_report_wakeups, dat);
+}
+
+static void libio_stats_signal(int sig, void *dat);
+static int stats_signal;
+
 int libio_wait(void)
 {
 	int ret;
 
+	if (!loop->use_timerfd) {
+		loop->wakeups_mark_time = libt_now();
+		if (libio_trace >= 2)
+			libt_add_timeout_slack(60, 10, libio_report_wakeups, NULL);
+		/* prefer a timerfd over millisecond timeouts */
+		ret = libt_timerfd();
+		if ((ret >= 0) && (libe_add_fd(ret, libio_timerfd, NULL) >= 0))
+			loop->use_timerfd = 1;
+		else
+			loop->use_timerfd = -1;
+		if (!stats_signal) {
+			/* signals are process-wide, the first loop takes it */
+			stats_signal = 1;
+			libio_add_signal(SIGUSR1, libio_stats_signal, NULL);
+		}
+	}
+	if (libio_reg->shared)
+		libio_apply_posted();
 	libio_flush();
-	ret = libe_wait(libt_get_waittime());
+	ret = libe_wait((loop->use_timerfd > 0) ? -1 : libt_get_waittime());
+	++loop->nwakeups;
 	if (ret < 0) {
 		if (errno != EINTR) {
 			elog(LOG_ERR, errno, "libio_wait");
@@ -25,33 +139,17 @@ int libio_wait(void)
 		}
 		/* preset ret, to avoid exiting */
 		ret = 0;
-	} else
-		libe_flush();
+	}
+	/* latency-critical sources, and their notifiers, go first */
+	libe_flush_prio(LIBE_PRIO_HIGH);
+	libt_flush_prio(LIBT_PRIO_HIGH);
+	libio_run_notifiers();
+	libe_flush();
 	libt_flush();
 	libio_run_notifiers();
 	return ret;
 }
 
-void elog(int prio, int errnum, const char *fmt, ...)
-{
-	char *str;
-	va_list va;
-
-	va_start(va, fmt);
-	vasprintf(&str, fmt, va);
-	va_end(va);
-	if (errnum) {
-		char *tmp = str;
-
-		asprintf(&str, "%s: %s", tmp, strerror(errnum));
-		free(tmp);
-	}
-	syslog(prio, "%s\n", str);
-	free(str);
-	if (prio <= LOG_CRIT)
-		exit(1);
-}
-
 void *zalloc(unsigned int size)
 {
 	void *ptr;
@@ -106,78 +204,6 @@ char *mygetsubopt(char *haystack)
 	return key;
 }
 
-static const char *vattr_reads(const char *fmt, va_list va)
-{
-	FILE *fp;
-	char *file;
-	static char *line;
-	static size_t linesize;
-	int ret;
-
-	vasprintf(&file, fmt, va);
-
-	fp = fopen(file, "r");
-	if (!fp) {
-		free(file);
-		return NULL;
-	}
-	ret = getline(&line, &linesize, fp);
-	fclose(fp);
-	free(file);
-	return (ret < 0) ? NULL : line;
-}
-
-const char *attr_reads(const char *fmt, ...)
-{
-	va_list va;
-	const char *result;
-
-	va_start(va, fmt);
-	result = vattr_reads(fmt, va);
-	va_end(va);
-	return result;
-}
-
-/* */
-int attr_read(int default_value, const char *fmt, ...)
-{
-	va_list va;
-	const char *result;
-
-	va_start(va, fmt);
-	result = vattr_reads(fmt, va);
-	va_end(va);
-
-	if (!result) {
-		elog(LOG_WARNING, errno, "fopen %s r", fmt);
-		return default_value;
-	}
-	return strtol(result, NULL, 0);
-}
-
-int attr_write(int value, const char *fmt, ...)
-{
-	FILE *fp;
-	int ret;
-	char *file;
-	va_list va;
-
-	va_start(va, fmt);
-	vasprintf(&file, fmt, va);
-	va_end(va);
-
-	fp = fopen(file, "w");
-	if (fp) {
-		ret = fprintf(fp, "%i\n", value);
-		fclose(fp);
-	} else {
-		elog(LOG_WARNING, errno, "fopen %s w", file);
-		ret = -1;
-	}
-	free(file);
-	return ret;
-}
-
 /* wildcard match */
 static int globerr(const char *path, int errnum)
 {
@@ -223,6 +249,48 @@ int schedule_itimer(double v)
 	return ret;
 }
 
+/* ITIMER replacement via timerfd */
+static int itimerfd = -1;
+
+static void itimerfd_expired(int fd, void *dat)
+{
+	uint64_t expirations;
+
+	if (read(fd, &expirations, sizeof(expirations)) <= 0)
+		return;
+	/* a SIGALRM handler via libio_add_signal runs in this loop too */
+	raise(SIGALRM);
+}
+
+int schedule_itimerfd(double v)
+{
+	int ret;
+	struct itimerspec it = {};
+	long il;
+
+	if (itimerfd < 0) {
+		itimerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (itimerfd < 0) {
+			elog(LOG_WARNING, errno, "timerfd_create");
+			return -1;
+		}
+		libe_add_fd(itimerfd, itimerfd_expired, NULL);
+	}
+
+	il = v*1e6;
+	it.it_value.tv_sec  = il/1000000;
+	it.it_value.tv_nsec = (il%1000000)*1000;
+	if (!it.it_value.tv_sec && !it.it_value.tv_nsec) {
+		it.it_value.tv_sec = 1;
+		it.it_value.tv_nsec = 0;
+	}
+
+	ret = timerfd_settime(itimerfd, 0, &it, NULL);
+	if (ret)
+		elog(LOG_WARNING, errno, "timerfd_settime(%.3lf)", v);
+	return ret;
+}
+
 /* iopars */
 static const struct {
 	const char *prefix;
@@ -235,6 +303,7 @@ static const struct {
 	{ "led", mkled, },
 	{ "backlight", mkbacklight, },
 	{ "battery", mkbatterypar, },
+	{ "gpio", mkgpio, },
 	{ "in", mkinputevbtn, },
 	{ "button", mkinputevbtn, },
 	{ "kbd", mkinputevbtn, },
@@ -245,6 +314,7 @@ static const struct {
 
 	{ "teleruptor", mkteleruptor, },
 	{ "vteleruptor", mkvirtualteleruptor, },
+	{ "expr", mkexpr, },
 
 	{ "netio", mknetiolocal, },
 	{ "unix", mknetiounix, },
@@ -262,21 +332,88 @@ void libio_set_trace(int value)
 	libio_trace = value;
 }
 
-/* tables */
-static struct iopar **table;
-static int tablesize, tablespot = 1;
+/* input-to-output latency, log2 histogram in microseconds */
+#define LAT_BUCKETS	32
+struct iopar_latency {
+	/* [j] counts latencies below 2^j us */
+	unsigned long hist[LAT_BUCKETS];
+	unsigned long n;
+	double max;
+};
+
+/* registries */
+static struct libio_registry defregistry = {
+	.tablespot = 1,
+};
+__thread struct libio_registry *libio_reg = &defregistry;
+
+static void free_registry_tables(struct libio_registry *r)
+{
+	int j;
+
+	for (j = 0; j < r->tablesize; ++j) {
+		if (r->latencies[j])
+			free(r->latencies[j]);
+	}
+	free(r->latencies);
+	free(r->origins);
+	free(r->table);
+	free(r->values);
+	free(r->states);
+	free(r->stats);
+	free(r->dirtynext);
+	free(r->pending);
+}
 
 __attribute__((destructor))
 static void free_table(void)
 {
-	if (table)
-		free(table);
+	free_registry_tables(&defregistry);
+}
+
+struct libio_registry *libio_registry_new(void)
+{
+	struct libio_registry *r;
+
+	r = zalloc(sizeof(*r));
+	r->tablespot = 1;
+	r->netio = netio_new();
+	return r;
+}
+
+struct libio_registry *libio_use_registry(struct libio_registry *r)
+{
+	struct libio_registry *prev = libio_reg;
+
+	libio_reg = r ?: &defregistry;
+	netio_use(libio_reg->netio);
+	return prev;
+}
+
+void libio_registry_free(struct libio_registry *r)
+{
+	struct libio_registry *prev;
+	int j;
+
+	if (!r || (r == &defregistry))
+		return;
+	prev = libio_use_registry(r);
+	/* newest first, they're often first in the lists of their type */
+	for (j = libio_reg->tablesize - 1; j > 0; --j) {
+		if (libio_reg->table[j])
+			destroy_iopar(j);
+	}
+	netio_free(r->netio);
+	libio_shared_free(r->shared);
+	libio_use_registry((prev == r) ? NULL : prev);
+	free_registry_tables(r);
+	free(r);
 }
 
 static inline struct iopar *_lookup_iopar(int iopar_id)
 {
-	return ((iopar_id >= 0) && (iopar_id < tablesize)) ?
-		table[iopar_id] : NULL;
+	return ((iopar_id >= 0) && (iopar_id < libio_reg->tablesize)) ?
+		libio_reg->table[iopar_id] : NULL;
 }
 
 struct iopar *lookup_iopar(int iopar_id)
@@ -284,30 +421,100 @@ struct iopar *lookup_iopar(int iopar_id)
 	return _lookup_iopar(iopar_id);
 }
 
-static void add_iopar(struct iopar *iopar)
+static void *grow_array(void *array, int elsize, int oldsize, int newsize)
 {
-	int oldtablesize = tablesize;
+	array = realloc(array, elsize*newsize);
+	if (!array)
+		elog(LOG_CRIT, errno, "realloc");
+	memset((char *)array + elsize*oldsize, 0, elsize*(newsize - oldsize));
+	return array;
+}
 
-	for (; tablespot < tablesize; ++tablespot) {
-		if (!table[tablespot])
+void iopar_init(struct iopar *iopar, const struct iopar_ops *ops)
+{
+	int oldtablesize = libio_reg->tablesize;
+
+	for (; libio_reg->tablespot < libio_reg->tablesize; ++libio_reg->tablespot) {
+		if (!libio_reg->table[libio_reg->tablespot])
 			goto empty_spot;
 	}
-	tablesize += 16;
-	table = realloc(table, sizeof(*table)*tablesize);
-	if (!table)
-		elog(LOG_CRIT, errno, "realloc");
-	memset(table + oldtablesize, 0,
-			sizeof(*table)*(tablesize - oldtablesize));
+	libio_reg->tablesize = libio_reg->tablesize ? libio_reg->tablesize*2 : 16;
+	libio_reg->table = grow_array(libio_reg->table, sizeof(*libio_reg->table),
+			oldtablesize, libio_reg->tablesize);
+	libio_reg->values = grow_array(libio_reg->values, sizeof(*libio_reg->values),
+			oldtablesize, libio_reg->tablesize);
+	libio_reg->states = grow_array(libio_reg->states, sizeof(*libio_reg->states),
+			oldtablesize, libio_reg->tablesize);
+	libio_reg->stats = grow_array(libio_reg->stats, sizeof(*libio_reg->stats),
+			oldtablesize, libio_reg->tablesize);
+	libio_reg->origins = grow_array(libio_reg->origins, sizeof(*libio_reg->origins),
+			oldtablesize, libio_reg->tablesize);
+	libio_reg->latencies = grow_array(libio_reg->latencies, sizeof(*libio_reg->latencies),
+			oldtablesize, libio_reg->tablesize);
+	libio_reg->dirtynext = grow_array(libio_reg->dirtynext, sizeof(*libio_reg->dirtynext),
+			oldtablesize, libio_reg->tablesize);
 empty_spot:
-	iopar->id = tablespot;
-	table[tablespot] = iopar;
-	++tablespot;
+	iopar->id = libio_reg->tablespot;
+	libio_reg->table[iopar->id] = iopar;
+	libio_reg->values[iopar->id] = 0;
+	libio_reg->states[iopar->id] = 0;
+	iopar_set_ops(iopar, ops);
+	memset(&libio_reg->stats[iopar->id], 0, sizeof(libio_reg->stats[0]));
+	libio_reg->origins[iopar->id] = 0;
+	++libio_reg->tablespot;
+	if (libio_reg->shared)
+		libio_publish(iopar->id);
+
+	/* remember it, in case its creation fails */
+	if (libio_reg->npending >= libio_reg->spending) {
+		libio_reg->spending = libio_reg->spending ? libio_reg->spending*2 : 16;
+		libio_reg->pending = realloc(libio_reg->pending,
+				sizeof(*libio_reg->pending)*libio_reg->spending);
+		if (!libio_reg->pending)
+			elog(LOG_CRIT, errno, "realloc");
+	}
+	libio_reg->pending[libio_reg->npending++] = iopar->id;
+}
+
+/* remove @iopar_id from the dirty list */
+static void iopar_unqueue(int iopar_id)
+{
+	int *pid, prev = 0;
+
+	if (!(libio_reg->states[iopar_id] & ST_QUEUED))
+		return;
+	for (pid = &libio_reg->dirty; *pid; pid = &libio_reg->dirtynext[*pid]) {
+		if (*pid == iopar_id) {
+			*pid = libio_reg->dirtynext[iopar_id];
+			if (libio_reg->dirtylast == iopar_id)
+				libio_reg->dirtylast = prev;
+			break;
+		}
+		prev = *pid;
+	}
+	libio_reg->states[iopar_id] &= ~ST_QUEUED;
+}
+
+/* free the slot of @iopar_id */
+static void release_iopar(int iopar_id)
+{
+	iopar_unqueue(iopar_id);
+	if (libio_reg->latencies[iopar_id]) {
+		free(libio_reg->latencies[iopar_id]);
+		libio_reg->latencies[iopar_id] = NULL;
+	}
+	libio_reg->table[iopar_id] = NULL;
+	libio_reg->states[iopar_id] = 0;
+	if (iopar_id < libio_reg->tablespot)
+		libio_reg->tablespot = iopar_id;
+	if (libio_reg->shared)
+		libio_publish(iopar_id);
 }
 
 struct iopar *create_libiopar(const char *str)
 {
 	const char *sep, *iostr;
-	int j, len;
+	int j, len, npending, id;
 	struct iopar *iopar;
 
 	sep = strchr(str, ':');
@@ -318,7 +525,14 @@ struct iopar *create_libiopar(const char *str)
 	iostr = sep + 1;
 	for (j = 0; iotypes[j].prefix; ++j) {
 		if (!strncmp(iotypes[j].prefix, str, len)) {
+			npending = libio_reg->npending;
 			iopar = iotypes[j].create(strdupa(iostr));
+			/* release the ids of parameters that did not make it */
+			while (libio_reg->npending > npending) {
+				id = libio_reg->pending[--libio_reg->npending];
+				if (!iopar || (id != iopar->id))
+					release_iopar(id);
+			}
 			if (iopar)
 				return iopar;
 			elog(LOG_NOTICE, 0, "%s %s failed", __func__, str);
@@ -338,7 +552,6 @@ int create_iopar(const char *str)
 	iopar = create_libiopar(str);
 	if (iopar) {
 		iopar->name = strdup(str);
-		add_iopar(iopar);
 		return iopar->id;
 	}
 	elog(LOG_NOTICE, 0, "%s %s failed", __func__, str);
@@ -381,53 +594,255 @@ void destroy_iopar(int iopar_id)
 		free(notifier);
 	}
 	/* iopar_id has proven valid here */
-	if (iopar->del)
-		iopar->del(iopar);
+	if (iopar->ops->del)
+		iopar->ops->del(iopar);
 	else
 		/* default cleanup: we cannot do anything else here */
 		cleanup_libiopar(iopar);
 
-	table[iopar_id] = NULL;
-	if (iopar_id < tablespot)
-		tablespot = iopar_id;
+	release_iopar(iopar_id);
 }
 
 /* iopar use */
-double get_iopar(int iopar_id)
+/* refresh the value of @iopar_id, when its type wants that */
+static inline void iopar_jitget(int iopar_id)
 {
-	struct iopar *iopar = _lookup_iopar(iopar_id);
+	struct iopar *iopar;
+	struct iopar_stats *st;
+	double t0;
 
-	if (!iopar) {
+	if (!(libio_reg->states[iopar_id] & ST_JITGET))
+		return;
+	iopar = libio_reg->table[iopar_id];
+	t0 = libt_now();
+	iopar->ops->jitget(iopar);
+	st = &libio_reg->stats[iopar->id];
+	st->jitgettime += libt_now() - t0;
+	++st->njitgets;
+}
+
+/* what is read from a change is caused by its origin */
+static inline void iopar_take_origin(int iopar_id)
+{
+	if (libio_reg->states[iopar_id] & ST_DIRTY)
+		libio_reg->origin = libio_reg->origins[iopar_id];
+}
+
+static void iopar_record_latency(int iopar_id, double latency)
+{
+	struct iopar_latency *lat = libio_reg->latencies[iopar_id];
+	unsigned long us = (latency > 0) ? latency*1e6 : 0;
+	int j;
+
+	if (!lat)
+		lat = libio_reg->latencies[iopar_id] = zalloc(sizeof(*lat));
+	for (j = 0; (j < LAT_BUCKETS-1) && (us >> j); ++j);
+	++lat->hist[j];
+	++lat->n;
+	if (latency > lat->max)
+		lat->max = latency;
+}
+
+/* upper bound of the @fraction percentile of @lat */
+static double latency_percentile(const struct iopar_latency *lat, double fraction)
+{
+	unsigned long sum = 0;
+	int j;
+
+	for (j = 0; j < LAT_BUCKETS-1; ++j) {
+		sum += lat->hist[j];
+		if (sum >= lat->n*fraction)
+			break;
+	}
+	return fmin((1UL << j)*1e-6, lat->max);
+}
+
+long iopar_latency(int iopar_id, double *p50, double *p99, double *max)
+{
+	struct iopar_latency *lat;
+
+	if (!_lookup_iopar(iopar_id)) {
+		errno = ENODEV;
+		return -1;
+	}
+	lat = libio_reg->latencies[iopar_id];
+	if (!lat)
+		return 0;
+	if (p50)
+		*p50 = latency_percentile(lat, 0.5);
+	if (p99)
+		*p99 = latency_percentile(lat, 0.99);
+	if (max)
+		*max = lat->max;
+	return lat->n;
+}
+
+double get_iopar(int iopar_id)
+{
+	if (!_lookup_iopar(iopar_id)) {
 		errno = ENODEV;
 		return NAN;
 	}
-	if (iopar->jitget)
-		iopar->jitget(iopar);
-	return iopar->value;
+	iopar_take_origin(iopar_id);
+	iopar_jitget(iopar_id);
+	return libio_reg->values[iopar_id];
 }
 
 int set_iopar(int iopar_id, double value)
 {
 	struct iopar *iopar = _lookup_iopar(iopar_id);
+	struct iopar_stats *st;
 	int ret;
-	double saved_value;
+	double saved_value, t0, t1;
 
 	if (!iopar) {
 		errno = ENODEV;
 		return -1;
 	}
-	if (!iopar->set) {
+	if (!iopar->ops->set) {
 		errno = ENOTSUP;
 		return -1;
 	}
 
-	saved_value = iopar->value;
-	ret = iopar->set(iopar, value);
-	if ((ret >= 0) && (iopar->value != saved_value))
-		iopar->state |= ST_DIRTY;
+	saved_value = libio_reg->values[iopar_id];
+	t0 = libt_now();
+	ret = iopar->ops->set(iopar, value);
+	t1 = libt_now();
+	st = &libio_reg->stats[iopar_id];
+	st->settime += t1 - t0;
+	++st->nsets;
+	if (libio_reg->origin)
+		iopar_record_latency(iopar_id, t1 - libio_reg->origin);
+	if ((ret >= 0) && (libio_reg->values[iopar_id] != saved_value))
+		iopar_set_dirty(iopar);
 	return ret;
 }
 
+int get_iopars(const int *iopar_ids, double *values, int n)
+{
+	int j, ret = 0;
+
+	for (j = 0; j < n; ++j) {
+		if (!_lookup_iopar(iopar_ids[j])) {
+			values[j] = NAN;
+			errno = ENODEV;
+			ret = -1;
+			continue;
+		}
+		iopar_take_origin(iopar_ids[j]);
+		iopar_jitget(iopar_ids[j]);
+		values[j] = libio_reg->values[iopar_ids[j]];
+	}
+	return ret;
+}
+
+int set_iopars(const int *iopar_ids, const double *values, int n)
+{
+	int j, ret = 0, saved_errno = 0;
+
+	/* gpio outputs of 1 request change at once */
+	gpio_hold_outputs();
+	for (j = 0; j < n; ++j) {
+		if (set_iopar(iopar_ids[j], values[j]) < 0) {
+			saved_errno = errno;
+			ret = -1;
+		}
+	}
+	if ((gpio_release_outputs() < 0) && !ret) {
+		saved_errno = errno;
+		ret = -1;
+	}
+	if (ret < 0)
+		errno = saved_errno;
+	return ret;
+}
+
+int libio_dirty_iopars(int *iopar_ids, int size, int skip)
+{
+	int id, n = 0;
+
+	for (id = libio_reg->dirty; id && (n < size); id = libio_reg->dirtynext[id]) {
+		if (!(libio_reg->states[id] & ST_DIRTY))
+			continue;
+		if (skip) {
+			--skip;
+			continue;
+		}
+		iopar_ids[n++] = id;
+	}
+	return n;
+}
+
+int get_iopar_stats(int iopar_id, struct iopar_stats *stats)
+{
+	struct iopar *iopar = _lookup_iopar(iopar_id);
+
+	if (!iopar) {
+		errno = ENODEV;
+		return -1;
+	}
+	*stats = libio_reg->stats[iopar_id];
+	return 0;
+}
+
+static int cmp_iopar_cost(const void *a, const void *b)
+{
+	const struct iopar_stats *sa = &libio_reg->stats[*(const int *)a];
+	const struct iopar_stats *sb = &libio_reg->stats[*(const int *)b];
+	double ca = sa->settime + sa->jitgettime;
+	double cb = sb->settime + sb->jitgettime;
+
+	return (ca < cb) ? 1 : ((ca > cb) ? -1 : 0);
+}
+
+void libio_log_stats(void)
+{
+	struct iopar_stats *st;
+	int *ids, n, j;
+	double now = libt_now();
+
+	ids = zalloc(sizeof(*ids)*(libio_reg->tablesize ?: 1));
+	for (n = 0, j = 0; j < libio_reg->tablesize; ++j) {
+		st = &libio_reg->stats[j];
+		if (libio_reg->table[j] && (st->nsets || st->njitgets || st->ndirty || st->npolls))
+			ids[n++] = j;
+	}
+	qsort(ids, n, sizeof(*ids), cmp_iopar_cost);
+	for (j = 0; j < n; ++j) {
+		st = &libio_reg->stats[ids[j]];
+		elog(LOG_INFO, 0, "%s: %lu sets %.3lfms, %lu jitgets %.3lfms, "
+				"%lu changes %lu notified, last %.1lfs ago",
+				libio_reg->table[ids[j]]->name ?: "?",
+				st->nsets, st->settime*1e3,
+				st->njitgets, st->jitgettime*1e3,
+				st->ndirty, st->nnotifies,
+				st->ndirty ? now - st->lastchange : NAN);
+		if (st->pollinterval)
+			elog(LOG_INFO, 0, "%s: %lu polls, now every %.3lfs",
+					libio_reg->table[ids[j]]->name ?: "?",
+					st->npolls, st->pollinterval);
+		else if (st->npolls || st->ncached)
+			elog(LOG_INFO, 0, "%s: %lu reads, %lu from cache, %.0lf%% hits",
+					libio_reg->table[ids[j]]->name ?: "?",
+					st->npolls, st->ncached,
+					st->ncached*100.0/(st->npolls + st->ncached));
+		if (libio_reg->latencies[ids[j]]) {
+			double p50, p99, max;
+			long n = iopar_latency(ids[j], &p50, &p99, &max);
+
+			elog(LOG_INFO, 0, "%s: latency p50 %.3lfms, p99 %.3lfms, max %.3lfms, %li samples",
+					libio_reg->table[ids[j]]->name ?: "?",
+					p50*1e3, p99*1e3, max*1e3, n);
+		}
+	}
+	free(ids);
+}
+
+static void libio_stats_signal(int sig, void *dat)
+{
+	libio_log_stats();
+}
+
 int iopar_dirty(int iopar_id)
 {
 	struct iopar *iopar = _lookup_iopar(iopar_id);
@@ -436,7 +851,7 @@ int iopar_dirty(int iopar_id)
 		errno = ENODEV;
 		return 0;
 	}
-	return (iopar->state & ST_DIRTY) ? 1 : 0;
+	return (libio_reg->states[iopar_id] & ST_DIRTY) ? 1 : 0;
 }
 
 int iopar_present(int iopar_id)
@@ -447,7 +862,7 @@ int iopar_present(int iopar_id)
 		errno = ENODEV;
 		return -1;
 	}
-	return (iopar->state & ST_PRESENT) ? 1 : 0;
+	return (libio_reg->states[iopar_id] & ST_PRESENT) ? 1 : 0;
 }
 
 const char *iopar_name(int iopar_id)
@@ -457,16 +872,41 @@ const char *iopar_name(int iopar_id)
 	return iopar ? iopar->name : NULL;
 }
 
+void iopar_queue_dirty(struct iopar *iopar)
+{
+	struct iopar_stats *st = &libio_reg->stats[iopar->id];
+
+	++st->ndirty;
+	st->lastchange = libt_now();
+	/* the change inherits the origin of what caused it */
+	libio_reg->origins[iopar->id] = libio_reg->origin ?: st->lastchange;
+	libio_reg->states[iopar->id] |= ST_QUEUED;
+	libio_reg->dirtynext[iopar->id] = 0;
+	if (libio_reg->dirtylast)
+		libio_reg->dirtynext[libio_reg->dirtylast] = iopar->id;
+	else
+		libio_reg->dirty = iopar->id;
+	libio_reg->dirtylast = iopar->id;
+}
+
 void libio_flush(void)
 {
-	int j;
+	int id;
 
-	longdet_flush();
+	/* long press detection serves the default registry only */
+	if (libio_reg == &defregistry)
+		longdet_flush();
 	netio_sync();
-	for (j = 1; j < tablesize; ++j) {
-		if (table[j])
-			table[j]->state &= ~ST_DIRTY;
+	gpio_flush();
+	libio_reg->origin = 0;
+	while (libio_reg->dirty) {
+		id = libio_reg->dirty;
+		libio_reg->dirty = libio_reg->dirtynext[id];
+		libio_reg->states[id] &= ~(ST_DIRTY | ST_NOTIFIED | ST_QUEUED);
+		if (libio_reg->shared)
+			libio_publish(id);
 	}
+	libio_reg->dirtylast = 0;
 }
 
 static void iopar_notify(struct iopar *iopar)
@@ -479,12 +919,23 @@ static void iopar_notify(struct iopar *iopar)
 
 void libio_run_notifiers(void)
 {
-	int j;
-
-	for (j = 1; j < tablesize; ++j) {
-		if (table[j] && (table[j]->state & ST_DIRTY))
-			iopar_notify(table[j]);
-	}
+	int id, last = 0;
+
+	do {
+		/* notifiers & expr parameters may append to the list */
+		for (id = last ? libio_reg->dirtynext[last] : libio_reg->dirty;
+				id; id = libio_reg->dirtynext[id]) {
+			last = id;
+			if ((libio_reg->states[id] & (ST_DIRTY | ST_NOTIFIED)) == ST_DIRTY) {
+				/* notify once per change */
+				libio_reg->states[id] |= ST_NOTIFIED;
+				++libio_reg->stats[id].nnotifies;
+				libio_reg->origin = libio_reg->origins[id];
+				iopar_notify(libio_reg->table[id]);
+			}
+		}
+		libio_reg->origin = 0;
+	} while (expr_flush());
 }
 
 /* direct event notifications */
@@ -13,6 +13,47 @@ extern void elog(int prio, int errnum, const char *fmt, ...)
 
 /* core loop */
 extern int libio_wait(void);
+/* average libio_wait wakeups per second, since the previous call */
+extern double libio_wakeup_rate(void);
+
+/*
+ * contexts
+ * A loop holds the libe & libt contexts that libio_wait runs,
+ * a registry holds the parameter table & netio sockets.
+ * Each thread has a current loop & registry, which are the
+ * process-wide defaults unless selected otherwise.
+ * Parameters register with the loop that is current at creation,
+ * so a thread selects both before creating its parameters.
+ * Signals & schedule_itimerfd are process-wide, they run in the loop
+ * that was current on their first use.
+ */
+struct libio_loop;
+struct libio_registry;
+
+extern struct libio_loop *libio_loop_new(void);
+extern void libio_loop_free(struct libio_loop *loop);
+/* select @loop for this thread, NULL selects the default, returns previous */
+extern struct libio_loop *libio_use_loop(struct libio_loop *loop);
+
+extern struct libio_registry *libio_registry_new(void);
+/* destroy all parameters of @reg, and free it */
+extern void libio_registry_free(struct libio_registry *reg);
+/* select @reg for this thread, NULL selects the default, returns previous */
+extern struct libio_registry *libio_use_registry(struct libio_registry *reg);
+
+/*
+ * concurrent access
+ * libio_share_registry lets other threads use the current registry,
+ * call it from the loop thread, before starting those threads.
+ * Other threads select the same registry, and use only
+ * peek_iopar & post_iopar, which do not lock.
+ * peek_iopar returns the value as the last libio_wait cycle propagated it,
+ * without refreshing it. It returns 1 when present, 0 when not, -1 on error.
+ * post_iopar queues a set_iopar, to run at the start of the next cycle.
+ */
+extern int libio_share_registry(void);
+extern int peek_iopar(int iopar, double *value);
+extern int post_iopar(int iopar, double value);
 
 /* GENERIC */
 extern void register_applet(const char *name, int (*fn)(int, char *[]));
@@ -35,7 +76,11 @@ extern int strlookup(const char *str, const char *const table[]);
 extern char *mygetsubopt(char *key);
 extern char *mygetsuboptvalue(void);
 
-/* sysfs (or any other file) iface */
+/* sysfs (or any other file) iface
+ * Files remain open in a small cache per thread.
+ * attr_reads returns the first line in that cache, valid until
+ * the next attr_read(s) or attr_write of the same thread.
+ */
 extern const char *attr_reads(const char *fmt, ...)
 	__attribute__((format(printf,1,2)));
 extern int attr_read(int default_value, const char *fmt, ...)
@@ -51,6 +96,18 @@ extern char *findfile(const char *pattern);
 
 /* set single event with itimer */
 extern int schedule_itimer(double value);
+/* raise SIGALRM after @value seconds, from within libio_wait
+ * This avoids interrupting libio_wait with EINTR
+ */
+extern int schedule_itimerfd(double value);
+
+/* call @fn from libio_wait when @sig arrives
+ * @sig is blocked, and read via a signalfd.
+ */
+extern int libio_add_signal(int sig, void (*fn)(int sig, void *), void *dat);
+extern int libio_del_signal(int sig, void (*fn)(int sig, void *), void *dat);
+/* unblock those signals again, in a forked child before exec */
+extern void libio_unblock_signals(void);
 
 struct iopar;
 
@@ -62,6 +119,53 @@ extern void destroy_iopar(int iopar);
 extern double get_iopar(int iopar);
 extern int set_iopar(int iopar, double value);
 
+/*
+ * vector access, for groups of parameters
+ * get_iopars stores NAN for invalid ids.
+ * Both process all @n parameters, and return -1 with errno set
+ * when any of them failed.
+ */
+extern int get_iopars(const int *iopars, double *values, int n);
+extern int set_iopars(const int *iopars, const double *values, int n);
+/*
+ * fill @iopars with the parameters that changed since the last cycle,
+ * in order of change, and return how many. When @iopars was full,
+ * call again with the number fetched so far as @skip.
+ */
+extern int libio_dirty_iopars(int *iopars, int size, int skip);
+
+/* per-parameter statistics */
+struct iopar_stats {
+	unsigned long nsets, njitgets;
+	/* changes, and notifier runs for them */
+	unsigned long ndirty, nnotifies;
+	/* seconds spent in the type's set & jitget */
+	double settime, jitgettime;
+	/* libt_now() of the last change */
+	double lastchange;
+	/* polls of periodically read parameters, and the current interval,
+	 * 0 for parameters read on demand
+	 */
+	unsigned long npolls;
+	double pollinterval;
+	/* gets of on demand parameters that needed no read */
+	unsigned long ncached;
+};
+extern int get_iopar_stats(int iopar, struct iopar_stats *stats);
+/* log the statistics of the used parameters, costliest first.
+ * libio_wait does this on SIGUSR1 too.
+ */
+extern void libio_log_stats(void);
+
+/*
+ * latency of the sets on @iopar, since the event that caused them.
+ * An input event stamps its change with the time it happened,
+ * and each change passes that origin to the sets that follow
+ * from reading it, also via netio.
+ * Returns the number of samples, with percentiles in seconds.
+ */
+extern long iopar_latency(int iopar, double *p50, double *p99, double *max);
+
 /* return true when iopar is dirty */
 extern int iopar_dirty(int iopar);
 /* return true when iopar is lost */
@@ -69,11 +173,19 @@ extern int iopar_present(int iopar);
 /* return the name used during construction */
 extern const char *iopar_name(int iopar);
 
-/* fetch with constant from /etc/libio-const.conf */
+/* fetch with constant from .libio & /etc/libio.conf
+ * $LIBIO_CONSTCACHE names a cache file of the parsed result
+ */
 extern const char *libio_strconst(const char *name);
 extern double libio_const(const char *name);
 /* external iterator */
 extern const char *libio_next_const(const char *name);
+/* call @fn when the const files changed and are reloaded,
+ * the first notifier starts watching those files
+ */
+extern int libio_add_const_notifier(void (*fn)(void *dat), void *dat);
+/* incremented on each reload */
+extern unsigned long libio_consts_generation(void);
 
 /* netio: publish local parameter via this socket */
 extern int libio_bind_net(const char *uri);
@@ -14,11 +14,14 @@ struct ld {
 	int oldvalue;
 	int instate;
 	double delay;
+	/* delay follows the 'longpress' const */
+	int dfltdelay;
 };
 
 /* globals */
 static struct ld *longdet_list;
 static int longdet_nr;
+static double default_delay;
 
 void longdet_flush(void)
 {
@@ -79,7 +82,8 @@ void set_longdet(int id, double value)
 	if (ld->instate == ivalue)
 		return;
 	if (ivalue) {
-		libt_add_timeout(ld->delay, longdetection_timeout, ld);
+		libt_add_timeout_prio(ld->delay, 0, LIBT_PRIO_HIGH,
+				longdetection_timeout, ld);
 	} else if (ld->instate) {
 		/* released */
 		if (ld->value == LONGPRESS) {
@@ -94,18 +98,34 @@ void set_longdet(int id, double value)
 	ld->instate = ivalue;
 }
 
+static void load_longpress(void *dat)
+{
+	struct ld *ld;
+
+	default_delay = libio_const("longpress");
+	if (isnan(default_delay))
+		default_delay = 0.5;
+	/* running timeouts keep their delay */
+	for (ld = longdet_list; ld; ld = ld->next) {
+		if (ld->dfltdelay)
+			ld->delay = default_delay;
+	}
+}
+
 int new_longdet(void)
 {
-	static double default_delay;
 	static int loaded = 0;
+	int id;
 
 	if (!loaded) {
-		default_delay = libio_const("longpress");
-		if (isnan(default_delay))
-			default_delay = 0.5;
+		load_longpress(NULL);
+		/* follow edits of the config */
+		libio_add_const_notifier(load_longpress, NULL);
 		loaded = 1;
 	}
-	return new_longdet1(default_delay);
+	id = new_longdet1(default_delay);
+	find_ld(id)->dfltdelay = 1;
+	return id;
 }
 
 int new_longdet1(double delay)
@@ -89,12 +89,12 @@ static inline struct motor *dirpar2motor(struct iopar *iopar)
 /* generic control */
 static inline double motor_curr_speed(struct motor *mot)
 {
-	return mot->dirpar.value;
+	return iopar_value(&mot->dirpar);
 }
 
 static inline double motor_curr_position(struct motor *mot)
 {
-	return mot->pospar.value;
+	return iopar_value(&mot->pospar);
 }
 
 static inline int motor_moving(struct motor *mot)
@@ -109,13 +109,13 @@ static void motor_update_position(struct motor *mot)
 
 	currtime = libt_now();
 	if (motor_curr_speed(mot) != 0) {
-		mot->pospar.value +=
+		iopar_value(&mot->pospar) +=
 			(motor_curr_speed(mot) * (currtime - mot->lasttime)) /
 			mot->maxval;
-		if (mot->pospar.value < 0)
-			mot->pospar.value = 0;
-		else if (mot->pospar.value > 1)
-			mot->pospar.value = 1;
+		if (iopar_value(&mot->pospar) < 0)
+			iopar_value(&mot->pospar) = 0;
+		else if (iopar_value(&mot->pospar) > 1)
+			iopar_value(&mot->pospar) = 1;
 		iopar_set_dirty(&mot->pospar);
 	}
 	mot->lasttime = currtime;
@@ -125,7 +125,7 @@ static void keep_motor_power(void *dat)
 {
 	struct motor *mot = dat;
 
-	if (labs(mot->dirpar.value) < 0.001)
+	if (labs(iopar_value(&mot->dirpar)) < 0.001)
 		/* stopp polling */
 		return;
 
@@ -143,7 +143,7 @@ static void keep_motor_power(void *dat)
 	set_iopar(mot->out2, NAN);
 
 	motor_update_position(mot);
-	mot->dirpar.value = 0;
+	iopar_value(&mot->dirpar) = 0;
 	iopar_set_dirty(&mot->dirpar);
 }
 
@@ -181,7 +181,7 @@ static int change_motor_speed(struct motor *mot, double speed)
 		libt_add_timeout(0.5, keep_motor_power, mot);
 	}
 	motor_update_position(mot);
-	mot->dirpar.value = speed;
+	iopar_value(&mot->dirpar) = speed;
 	iopar_set_dirty(&mot->dirpar);
 	return 0;
 fail_21:
@@ -411,6 +411,16 @@ struct iopar *mkmotorpos(char *cstr)
 	return result;
 }
 
+static const struct iopar_ops motor_dir_ops = {
+	.del = del_motor_dir,
+	.set = set_motor_dir,
+};
+
+static const struct iopar_ops motor_pos_ops = {
+	.del = del_motor_pos,
+	.set = set_motor_pos,
+};
+
 struct iopar *mkmotordir(char *str)
 {
 	struct motor *mot;
@@ -419,13 +429,8 @@ struct iopar *mkmotordir(char *str)
 
 	mot = zalloc(sizeof(*mot));
 	mot->flags = EOL0 | EOL1;
-	mot->dirpar.del = del_motor_dir;
-	mot->dirpar.set = set_motor_dir;
-	mot->dirpar.value = 0;
-
-	mot->pospar.del = del_motor_pos;
-	mot->pospar.set = set_motor_pos;
-	mot->pospar.value = 0;
+	iopar_init(&mot->dirpar, &motor_dir_ops);
+	iopar_init(&mot->pospar, &motor_pos_ops);
 
 	for (ntok = 0, tok = strtok_r(str, "+", &saved); tok && (ntok < 4); ++ntok, tok = strtok_r(NULL, "+", &saved))
 	switch (ntok) {
@@ -3,6 +3,7 @@
 #include <string.h>
 #include <errno.h>
 #include <math.h>
+#include <stdint.h>
 
 #include <unistd.h>
 #include <fcntl.h>
@@ -33,6 +34,8 @@ struct sockparam {
 	struct ioremote *remote;
 	struct sockparam *next;
 	double newvalue;
+	/* origin of newvalue, for latency tracing */
+	double neworigin;
 	int state;
 		#define ST_WRITABLE	0x01
 		#define ST_WAITING	0x02 /* waiting for transmission, ... */
@@ -50,6 +53,13 @@ struct ioremote {
 	int flags;
 		#define FL_SENDTO	0x01
 		#define FL_RECVFROM	0x02
+		/*
+		 * output is pending, because the socket would block
+		 * Only the latest values are kept, the pending output
+		 * is bounded by the number of parameters.
+		 */
+		#define FL_RESYNC	0x04 /* send all local parameters */
+		#define FL_TXPENDING	0x08 /* send ST_WAITING parameters */
 	time_t last_recvfrom_time;
 };
 
@@ -66,6 +76,7 @@ struct iosocket {
 		 *    results in a new socket address.
 		 */
 		#define FL_MYPUBLIC_SOCK	0x01
+		#define FL_WANTWR		0x02 /* LIBE_WR is set */
 };
 
 struct netiomsg {
@@ -78,25 +89,38 @@ struct netiomsg {
 
 #define NETIO_MTU	1500
 #define NETIO_PINGTIME	1
+/* keepalives may be late, to share a wakeup with other timers */
+#define NETIO_PINGSLACK	0.25
+/* retry blocked output, when writability did not help */
+#define NETIO_RETRYTIME	0.05
 
 #define NIOSOCKETS PF_MAX
-static struct iosocket *iosockets[PF_MAX];
-static struct iosocket *pubsockets[PF_MAX];
-static int netio_dirty;
-static struct sockparam *localparams;
-/* netiomsg queue (first & last) */
-static struct netiomsg *netiomsgq, *netiomsgqlast;
-static struct netiomsg *netiomsgp;
-static unsigned int netiomsgid;
-static int netiomsg_acked;
+/* netio state, part of a libio registry */
+struct netio {
+	struct iosocket *iosockets[PF_MAX];
+	struct iosocket *pubsockets[PF_MAX];
+	/* netio_keepalive runs for this context */
+	int keepalive_scheduled;
+	int netio_dirty;
+	struct sockparam *localparams;
+	/* netiomsg queue (first & last) */
+	struct netiomsg *netiomsgq, *netiomsgqlast;
+	struct netiomsg *netiomsgp;
+	unsigned int netiomsgid;
+	int netiomsg_acked;
+};
+
+static struct netio defnetio;
+/* netio state of the current registry of this thread */
+static __thread struct netio *nio = &defnetio;
 
 /* locally used buffer */
-static char pktbuf[NETIO_MTU+1];
+static __thread char pktbuf[NETIO_MTU+1];
 
 /* list management */
 static void add_sockparam(struct sockparam *par, struct ioremote *rem)
 {
-	struct sockparam **ppar = rem ? &rem->params : &localparams;
+	struct sockparam **ppar = rem ? &rem->params : &nio->localparams;
 
 	par->next = *ppar;
 	*ppar = par;
@@ -107,7 +131,7 @@ static void add_sockparam(struct sockparam *par, struct ioremote *rem)
 static void del_sockparam(struct sockparam *par)
 {
 	struct sockparam **ppar =
-		par->remote ? &par->remote->params : &localparams;
+		par->remote ? &par->remote->params : &nio->localparams;
 
 	for (; *ppar; ppar = &(*ppar)->next) {
 		if (*ppar == par) {
@@ -217,41 +241,219 @@ int netio_strtosockname(const char *uri, void *paddr, int family)
 	}
 }
 
+/* output */
+static inline int netio_blocked(int err)
+{
+	return (err == EAGAIN) || (err == EWOULDBLOCK) || (err == ENOBUFS);
+}
+
+static void write_iosocket(int fd, void *data);
+
+static void netio_want_write(struct iosocket *sk, int want)
+{
+	if (!want == !(sk->flags & FL_WANTWR))
+		return;
+	sk->flags ^= FL_WANTWR;
+	libe_mod_fd(sk->fd, LIBE_RD | LIBE_ET | (want ? LIBE_WR : 0));
+}
+
+/* returns 0 on success, 1 when blocked */
+static int netio_sendto(struct ioremote *remote, const char *pkt, int len,
+		const char *errmsg)
+{
+	if (sendto(remote->sock->fd, pkt, len, 0, &remote->name.sa,
+				remote->namelen) >= 0)
+		return 0;
+	if (netio_blocked(errno)) {
+		netio_want_write(remote->sock, 1);
+		return 1;
+	}
+	if (errno != ECONNREFUSED)
+		elog(LOG_WARNING, errno, "%s", errmsg);
+	return 0;
+}
+
+/*
+ * append a '<name><op><value>' line to pktbuf at @len
+ * returns the new length, or -1 when it does not fit in 1 packet
+ */
+static int netio_putline(int len, const char *name, char op, double value,
+		double origin)
+{
+	int ret;
+
+	if (origin)
+		/* older peers' strtod ignores the age of the change */
+		ret = snprintf(pktbuf+len, NETIO_MTU-len, "%s%c%lf @%.6lf\n",
+				name, op, value, libt_now() - origin);
+	else
+		ret = snprintf(pktbuf+len, NETIO_MTU-len, "%s%c%lf\n", name, op, value);
+	return (ret < NETIO_MTU-len) ? len+ret : -1;
+}
+
+/* take the origin of a received change from its age */
+static void netio_recv_origin(struct sockparam *par, const char *str)
+{
+	str = strstr(str, " @");
+	if (str)
+		iopar_set_origin(&par->iopar, libt_now() - strtod(str+2, NULL));
+}
+
+/*
+ * send all local parameters to @remote, in as many packets as needed
+ * returns 1 when blocked, -1 on error
+ */
+static int netio_send_snapshot(struct ioremote *remote)
+{
+	struct sockparam *par;
+	int len, ret;
+
+	/* a snapshot is no change, it has no origin */
+	for (len = 0, par = nio->localparams; par; par = par->next) {
+		ret = netio_putline(len, par->name, '=', iopar_value(&par->iopar), 0);
+		if ((ret < 0) && len) {
+			/* packet full */
+			if (sendto(remote->sock->fd, pktbuf, len, 0,
+					&remote->name.sa, remote->namelen) < 0)
+				goto fail;
+			len = 0;
+			ret = netio_putline(len, par->name, '=', iopar_value(&par->iopar), 0);
+		}
+		if (ret >= 0)
+			len = ret;
+	}
+	if (sendto(remote->sock->fd, pktbuf, len, 0, &remote->name.sa,
+				remote->namelen) < 0)
+		goto fail;
+	return 0;
+fail:
+	if (netio_blocked(errno)) {
+		netio_want_write(remote->sock, 1);
+		return 1;
+	}
+	return -1;
+}
+
+/* send the write requests to @remote, returns 1 when blocked */
+static int netio_send_writes(struct ioremote *remote)
+{
+	struct sockparam *par;
+	int len, ret;
+
+	/* add remote waiting parameters */
+	len = 0;
+	for (par = remote->params; par; par = par->next) {
+		if (!(par->state & ST_WAITING))
+			continue;
+		ret = netio_putline(len, par->name, '>', par->newvalue,
+					par->neworigin);
+		if ((ret < 0) && len) {
+			/* packet full */
+			if (netio_sendto(remote, pktbuf, len, "netio_sync client"))
+				goto blocked;
+			len = 0;
+			ret = netio_putline(len, par->name, '>', par->newvalue,
+					par->neworigin);
+		}
+		if (ret >= 0)
+			len = ret;
+	}
+	/* test if we need to send */
+	if (len && netio_sendto(remote, pktbuf, len, "netio_sync client"))
+		goto blocked;
+	for (par = remote->params; par; par = par->next)
+		par->state &= ~ST_WAITING;
+	remote->flags &= ~FL_TXPENDING;
+	return 0;
+blocked:
+	/* keep ST_WAITING, newer values replace the pending ones */
+	remote->flags |= FL_TXPENDING;
+	return 1;
+}
+
+/* send pending output of @remote, returns 1 when still blocked */
+static int netio_flush_remote(struct ioremote *remote)
+{
+	int ret;
+
+	if (remote->flags & FL_RESYNC) {
+		ret = netio_send_snapshot(remote);
+		if (ret > 0)
+			return 1;
+		if ((ret < 0) && (errno != ECONNREFUSED))
+			elog(LOG_WARNING, errno, "netio resync");
+		remote->flags &= ~FL_RESYNC;
+	}
+	if (remote->flags & FL_TXPENDING)
+		return netio_send_writes(remote);
+	return 0;
+}
+
+static void netio_retry_write(void *dat)
+{
+	struct iosocket *sk = dat;
+
+	write_iosocket(sk->fd, sk);
+}
+
+static void write_iosocket(int fd, void *data)
+{
+	struct iosocket *sk = data;
+	struct ioremote *remote;
+	int blocked = 0;
+
+	for (remote = sk->remotes; remote; remote = remote->next)
+		blocked |= netio_flush_remote(remote);
+	netio_want_write(sk, 0);
+	if (blocked)
+		/*
+		 * a datagram socket may be writable while the peer still
+		 * blocks. Retry a bit later, rather than spinning
+		 */
+		libt_add_timeout(NETIO_RETRYTIME, netio_retry_write, sk);
+	else
+		libt_remove_timeout(netio_retry_write, sk);
+}
+
 /* timers */
 static void netio_keepalive(void *dat)
 {
 	static const char pktmst[] = "*keepalive\n";
 	static const char pktslv[] = "*subscribe\n";
+	struct netio *saved = nio;
 	int j;
 	struct ioremote *remote;
 
+	/* the context that scheduled it, not the current one */
+	nio = dat;
 	/* loop over remotes to send update to */
 	for (j = 0; j < NIOSOCKETS; ++j) {
-		if (!pubsockets[j])
+		if (!nio->pubsockets[j])
 			continue;
-		for (remote = pubsockets[j]->remotes; remote; remote = remote->next) {
-			sendto(pubsockets[j]->fd, pktmst, sizeof(pktmst), 0,
-						&remote->name.sa, remote->namelen);
+		for (remote = nio->pubsockets[j]->remotes; remote; remote = remote->next) {
+			libe_sendto(nio->pubsockets[j]->fd, pktmst, sizeof(pktmst),
+					&remote->name.sa, remote->namelen, NULL, NULL);
 		}
 	}
 	for (j = 0; j < NIOSOCKETS; ++j) {
-		if (!iosockets[j])
+		if (!nio->iosockets[j])
 			continue;
-		for (remote = iosockets[j]->remotes; remote; remote = remote->next) {
-			sendto(iosockets[j]->fd, pktslv, sizeof(pktslv), 0,
-						&remote->name.sa, remote->namelen);
+		for (remote = nio->iosockets[j]->remotes; remote; remote = remote->next) {
+			libe_sendto(nio->iosockets[j]->fd, pktslv, sizeof(pktslv),
+					&remote->name.sa, remote->namelen, NULL, NULL);
 		}
 	}
-	libt_add_timeout(NETIO_PINGTIME, netio_keepalive, dat);
+	libt_add_timeout_slack(NETIO_PINGTIME, NETIO_PINGSLACK,
+			netio_keepalive, dat);
+	nio = saved;
 }
 
 static void netio_schedule_keepalive(void)
 {
-	static int netio_keepalive_scheduled;
-
-	if (!netio_keepalive_scheduled)
-		libt_add_timeout(NETIO_PINGTIME, netio_keepalive, NULL);
-	netio_keepalive_scheduled = 1;
+	if (!nio->keepalive_scheduled)
+		libt_add_timeout_slack(NETIO_PINGTIME, NETIO_PINGSLACK,
+				netio_keepalive, nio);
+	nio->keepalive_scheduled = 1;
 }
 
 static void netio_lost_remote(void *param)
@@ -292,26 +494,32 @@ static struct sockparam *find_param(const char *name, struct sockparam *list)
 	return NULL;
 }
 
-static void read_iosocket(int fd, void *data)
+/* process 1 packet, from libe_add_recv */
+static void recv_iosocket(int fd, const void *pkt, int recvlen,
+		const struct sockaddr *sa, int salen, void *data)
 {
 	struct iosocket *sk = data;
 	struct ioremote *remote;
 	struct sockparam *par;
 	socklen_t namelen;
-	int ret, recvlen, saved_remote_flags;
+	int saved_remote_flags;
 	char *tok, *dat, *savedstr;
 	union sockaddrs name;
 
-	/* fetch packet */
-	namelen = sizeof(name);
-	recvlen = ret = recvfrom(fd, pktbuf, NETIO_MTU, 0, &name.sa, &namelen);
-	if (ret < 0) {
+	if (recvlen < 0) {
 		libe_remove_fd(fd);
 		close(fd);
 		/* TODO: proper cleanup */
 		return;
 	}
+	/* copy the packet, it is parsed in place */
+	if (recvlen > NETIO_MTU)
+		recvlen = NETIO_MTU;
+	memcpy(pktbuf, pkt, recvlen);
 	pktbuf[recvlen] = 0;
+	namelen = (salen < sizeof(name)) ? salen : sizeof(name);
+	memset(&name, 0, sizeof(name));
+	memcpy(&name, sa, namelen);
 
 	/* find remote */
 	for (remote = sk->remotes; remote; remote = remote->next) {
@@ -367,11 +575,11 @@ static void read_iosocket(int fd, void *data)
 				strcpy(msg->txt, tok);
                                 
 				/* queue netiomsg */
-				if (netiomsgqlast)
-					netiomsgqlast->next = msg;
+				if (nio->netiomsgqlast)
+					nio->netiomsgqlast->next = msg;
 				else
-					netiomsgq = msg;
-				netiomsgqlast = msg;
+					nio->netiomsgq = msg;
+				nio->netiomsgqlast = msg;
 			}
 			continue;
 		}
@@ -391,8 +599,9 @@ static void read_iosocket(int fd, void *data)
 			if (!par)
 				/* TODO: auto-create */
 				break;
-			par->iopar.value = strtod(dat, NULL);
+			iopar_value(&par->iopar) = strtod(dat, NULL);
 			iopar_set_dirty(&par->iopar);
+			netio_recv_origin(par, dat);
 			iopar_set_present(&par->iopar);
 			if (libio_trace >= 3)
 				fprintf(stderr, "netio:%s %s\n", par->name, dat);
@@ -404,7 +613,7 @@ static void read_iosocket(int fd, void *data)
 			}
 			/* write request for local parameter */
 			*dat++ = 0;
-			par = find_param(tok, localparams);
+			par = find_param(tok, nio->localparams);
 			if (!par)
 				break;
 			if (!(par->state & ST_WRITABLE)) {
@@ -413,10 +622,11 @@ static void read_iosocket(int fd, void *data)
 				break;
 			}
 			/* trigger broadcast */
-			netio_dirty = 1;
+			nio->netio_dirty = 1;
 			/* set parameter */
-			par->iopar.value = strtod(dat, NULL);
+			iopar_value(&par->iopar) = strtod(dat, NULL);
 			iopar_set_dirty(&par->iopar);
+			netio_recv_origin(par, dat);
 			if (libio_trace >= 3)
 				fprintf(stderr, "netio:%s %s\n", par->name, dat);
 			break;
@@ -424,14 +634,12 @@ static void read_iosocket(int fd, void *data)
 	}
 	/* actions for remote */
 	if ((remote->flags ^ saved_remote_flags) & FL_SENDTO) {
-		int len = 0;
+		int ret;
 		/* new consumer, emit all params */
-		len += snprintf(pktbuf+len, NETIO_MTU-len, "*initial\n");
-		for (len = 0, par = localparams; par; par = par->next) {
-			len += snprintf(pktbuf+len, NETIO_MTU-len, "%s=%lf\n",
-					par->name, par->iopar.value);
-		}
-		if (sendto(fd, pktbuf, len, 0, &remote->name.sa, remote->namelen) < 0) {
+		ret = netio_send_snapshot(remote);
+		if (ret > 0)
+			remote->flags |= FL_RESYNC;
+		else if (ret < 0) {
 			elog(LOG_WARNING, errno, "send initial packet");
 			/* clear flag */
 			remote->flags &= ~FL_SENDTO;
@@ -439,6 +647,15 @@ static void read_iosocket(int fd, void *data)
 	}
 }
 
+static void add_iosocket(struct iosocket *iosock)
+{
+	/* never block the loop on a slow remote */
+	fcntl(iosock->fd, F_SETFL, fcntl(iosock->fd, F_GETFL) | O_NONBLOCK);
+	libe_add_recv(iosock->fd, recv_iosocket, iosock);
+	libe_set_wrfn(iosock->fd, write_iosocket);
+	libe_mod_fd(iosock->fd, LIBE_RD | LIBE_ET);
+}
+
 /* socket creation */
 static int netio_autobind(int family)
 {
@@ -446,7 +663,7 @@ static int netio_autobind(int family)
 	int ret, sk, namelen;
 	union sockaddrs name;
 
-	if (iosockets[family])
+	if (nio->iosockets[family])
 		return 0;
 
 	ret = sk = socket(family, SOCK_DGRAM/* | SOCK_CLOEXEC*/, 0);
@@ -469,8 +686,8 @@ static int netio_autobind(int family)
 	/* manage socket */
 	iosock = zalloc(sizeof(*iosock));
 	iosock->fd = sk;
-	libe_add_fd(sk, read_iosocket, iosock);
-	iosockets[name.sa.sa_family] = iosock;
+	add_iosocket(iosock);
+	nio->iosockets[name.sa.sa_family] = iosock;
 	netio_schedule_keepalive();
 	return sk;
 }
@@ -507,7 +724,7 @@ int libio_bind_net(const char *uri)
 		goto fail_sockname;
 
 	/* test for duplicate */
-	if (pubsockets[name.sa.sa_family])
+	if (nio->pubsockets[name.sa.sa_family])
 		elog(LOG_CRIT, 0, "duplicate family socket '%s'", uri);
 
 	/* socket creation */
@@ -530,8 +747,8 @@ int libio_bind_net(const char *uri)
 	iosock = zalloc(sizeof(*iosock));
 	iosock->fd = sk;
 	iosock->flags |= FL_MYPUBLIC_SOCK;
-	libe_add_fd(sk, read_iosocket, iosock);
-	pubsockets[name.sa.sa_family] = iosock;
+	add_iosocket(iosock);
+	nio->pubsockets[name.sa.sa_family] = iosock;
 	netio_schedule_keepalive();
 	return sk;
 
@@ -549,12 +766,13 @@ static int set_sockparam(struct iopar *iopar, double value)
 
 	if (par->remote) {
 		par->newvalue = value;
+		par->neworigin = libio_reg->origin;
 		par->state |= ST_WAITING;
 	} else {
 		iopar_set_present(iopar);
-		par->iopar.value = value;
+		iopar_value(&par->iopar) = value;
 	}
-	netio_dirty = 1;
+	nio->netio_dirty = 1;
 	return 0;
 }
 
@@ -567,6 +785,11 @@ static void del_sockparam_hook(struct iopar *iopar)
 	free(par);
 }
 
+static const struct iopar_ops sockparam_ops = {
+	.del = del_sockparam_hook,
+	.set = set_sockparam,
+};
+
 struct iopar *mknetiolocal(char *name)
 {
 	struct sockparam *par;
@@ -576,13 +799,12 @@ struct iopar *mknetiolocal(char *name)
 		par->state |= ST_WRITABLE;
 		++name;
 	}
+	iopar_init(&par->iopar, &sockparam_ops);
 	strcpy(par->name, name);
-	par->iopar.del = del_sockparam_hook;
-	par->iopar.set = set_sockparam;
-	par->iopar.value = NAN;
+	iopar_value(&par->iopar) = NAN;
 	/* trigger initial transmission */
 	par->state |= ST_NEW;
-	netio_dirty = 1;
+	nio->netio_dirty = 1;
 
 	/* register sockparam */
 	add_sockparam(par, NULL);
@@ -603,19 +825,17 @@ static struct iopar *mknetioremote(const char *uri, int family)
 		elog(LOG_WARNING, 0, "no parameter name for '%s'", uri);
 		goto fail_noname;
 	}
-	if (!iosockets[family] && (netio_autobind(family) < 0)) {
+	if (!nio->iosockets[family] && (netio_autobind(family) < 0)) {
 		elog(LOG_WARNING, 0, "no socket for '%s'", uri);
 		goto fail_family;
 	}
 
 	par = zalloc(sizeof(*par) + strlen(parname));
+	iopar_init(&par->iopar, &sockparam_ops);
 	strcpy(par->name, parname);
-	par->iopar.del = del_sockparam_hook;
-	par->iopar.set = set_sockparam;
-	par->iopar.value = 0;
 
 	/* register sockparam */
-	sock = iosockets[family];
+	sock = nio->iosockets[family];
 	/* lookup remote */
 	namelen = netio_strtosockname(uri, &name.sa, family);
 	if (namelen < 0)
@@ -632,7 +852,8 @@ static struct iopar *mknetioremote(const char *uri, int family)
 		memcpy(&remote->name, &name, namelen);
 		add_ioremote(remote, sock);
 		ret = sendto(sock->fd, "*subscribe\n", 10, 0, &name.sa, namelen);
-		if ((ret < 0) && (errno != ECONNREFUSED)) {
+		/* a blocked subscribe is repeated by netio_keepalive */
+		if ((ret < 0) && (errno != ECONNREFUSED) && !netio_blocked(errno)) {
 			elog(LOG_WARNING, errno, "subscribe failed");
 			del_ioremote(remote);
 			free(remote);
@@ -666,62 +887,95 @@ struct iopar *mknetioudp6(char *uri)
 }
 
 /* hook into iolib */
+/*
+ * result of a queued publish to the socket with fd @dat
+ * The remote is not known anymore, so when the socket's buffer was
+ * full, all its subscribers get a snapshot.
+ */
+static void netio_publish_done(int ret, void *dat)
+{
+	struct iosocket *sk;
+	struct ioremote *remote;
+	int j;
+
+	if (ret >= 0)
+		return;
+	if (!netio_blocked(-ret)) {
+		if (ret != -ECONNREFUSED)
+			elog(LOG_WARNING, -ret, "netio_sync public");
+		return;
+	}
+	for (j = 0; j < NIOSOCKETS; ++j) {
+		sk = nio->pubsockets[j];
+		if (!sk || (sk->fd != (intptr_t)dat))
+			continue;
+		for (remote = sk->remotes; remote; remote = remote->next)
+			remote->flags |= FL_RESYNC;
+		netio_want_write(sk, 1);
+	}
+}
+
+/*
+ * send @len bytes of pktbuf to the subscribers
+ * The sends are queued, io_uring submits them together with the wait.
+ */
+static void netio_publish(int len)
+{
+	struct ioremote *remote;
+	int j, fd;
+
+	for (j = 0; j < NIOSOCKETS; ++j) {
+		if (!nio->pubsockets[j])
+			continue;
+		fd = nio->pubsockets[j]->fd;
+		for (remote = nio->pubsockets[j]->remotes; remote; remote = remote->next) {
+			if (remote->flags & FL_RESYNC)
+				/* the pending snapshot will carry the new values */
+				continue;
+			libe_sendto(fd, pktbuf, len, &remote->name.sa, remote->namelen,
+					netio_publish_done, (void *)(intptr_t)fd);
+		}
+	}
+}
+
 void netio_sync(void)
 {
 	struct ioremote *remote;
 	struct sockparam *par;
-	int len, j;
+	int len, ret, j;
 
 	/* flush netiomsg queue */
 	while (netio_recv_msg()) ;
 
-	if (!netio_dirty)
+	if (!nio->netio_dirty)
 		return;
 	/* prepare local parameters update packet */
-	for (len = 0, par = localparams; par; par = par->next) {
-		if (par->state & ST_NEW) {
-			len += snprintf(pktbuf+len, NETIO_MTU-len, "%s=%lf\n",
-					par->name, par->iopar.value);
-			par->state &= ~ST_NEW;
-
-		} else if (par->iopar.state & ST_DIRTY)
-			len += snprintf(pktbuf+len, NETIO_MTU-len, "%s=%lf\n",
-					par->name, par->iopar.value);
-	}
-
-	for (j = 0; j < NIOSOCKETS; ++j) {
-		if (!pubsockets[j])
+	for (len = 0, par = nio->localparams; par; par = par->next) {
+		if (!(par->state & ST_NEW) && !(iopar_state(&par->iopar) & ST_DIRTY))
 			continue;
-		for (remote = pubsockets[j]->remotes; remote; remote = remote->next) {
-			/* test if we need to send */
-			if (sendto(pubsockets[j]->fd, pktbuf, len, 0, &remote->name.sa, remote->namelen) < 0)
-				if (errno != ECONNREFUSED)
-					elog(LOG_WARNING, errno, "netio_sync public");
+		par->state &= ~ST_NEW;
+		ret = netio_putline(len, par->name, '=', iopar_value(&par->iopar),
+					libio_reg->origins[par->iopar.id]);
+		if ((ret < 0) && len) {
+			/* packet full */
+			netio_publish(len);
+			len = 0;
+			ret = netio_putline(len, par->name, '=', iopar_value(&par->iopar),
+					libio_reg->origins[par->iopar.id]);
 		}
+		if (ret >= 0)
+			len = ret;
 	}
+	netio_publish(len);
 
 	/* loop over remotes to send update to */
 	for (j = 0; j < NIOSOCKETS; ++j) {
-		if (!iosockets[j])
+		if (!nio->iosockets[j])
 			continue;
-		for (remote = iosockets[j]->remotes; remote; remote = remote->next) {
-			/* add remote waiting parameters */
-			len = 0;
-			for (par = remote->params; par; par = par->next) {
-				if (par->state & ST_WAITING) {
-					len += snprintf(pktbuf+len, NETIO_MTU-len, "%s>%lf\n",
-							par->name, par->newvalue);
-					par->state &= ~ST_WAITING;
-				}
-			}
-			/* test if we need to send */
-			if (!len)
-				continue;
-			if (sendto(iosockets[j]->fd, pktbuf, len, 0, &remote->name.sa, remote->namelen) < 0)
-				elog(LOG_WARNING, errno, "netio_sync client");
-		}
+		for (remote = nio->iosockets[j]->remotes; remote; remote = remote->next)
+			netio_send_writes(remote);
 	}
-	netio_dirty = 0;
+	nio->netio_dirty = 0;
 }
 
 /* netio tools */
@@ -752,7 +1006,7 @@ static int netio_send_direct(const char *uri, const char *pkt, int connmayfail)
 	} while (!family);
 
 	/* autobind client socket */
-	if (!iosockets[family] && (netio_autobind(family) < 0))
+	if (!nio->iosockets[family] && (netio_autobind(family) < 0))
 		goto fail_family;
 
 	/* don't create a remote, just find a peername for use in sendto */
@@ -760,7 +1014,7 @@ static int netio_send_direct(const char *uri, const char *pkt, int connmayfail)
 	if (namelen < 0)
 		goto fail_sock;
 
-	ret = sendto(iosockets[family]->fd, pkt, strlen(pkt), 0, &name.sa, namelen);
+	ret = sendto(nio->iosockets[family]->fd, pkt, strlen(pkt), 0, &name.sa, namelen);
 	if (ret < 0) {
 		if (!connmayfail || (errno != ECONNREFUSED))
 			elog(LOG_WARNING, errno, "netio_send_msg");
@@ -783,10 +1037,10 @@ int netio_send_msg(const char *uri, const char *msg)
 	char *pkt;
 
 	pkt = alloca(strlen(msg ?: "") + 32);
-	sprintf(pkt, "*msg %u %s", ++netiomsgid, msg);
+	sprintf(pkt, "*msg %u %s", ++nio->netiomsgid, msg);
 	if (netio_send_direct(uri, pkt, 0) < 0)
 		return -1;
-	return netiomsgid;
+	return nio->netiomsgid;
 }
 
 int netio_ack_msg(const char *msg)
@@ -794,21 +1048,21 @@ int netio_ack_msg(const char *msg)
 	char *pkt;
 	int family;
 
-	if (netiomsg_acked++)
+	if (nio->netiomsg_acked++)
 		return -1;
-	if (!netiomsgp)
+	if (!nio->netiomsgp)
 		return -1;
-	family = netiomsgp->name.sa.sa_family;
+	family = nio->netiomsgp->name.sa.sa_family;
 
 	/* autobind client socket */
-	if (!pubsockets[family])
+	if (!nio->pubsockets[family])
 		return -1;
 
 	pkt = alloca(strlen(msg ?: "") + 32);
-	sprintf(pkt, "*ack %u %s", netiomsgp->id, msg);
-	if (sendto(pubsockets[netiomsgp->name.sa.sa_family]->fd, pkt, strlen(pkt), 0,
-				&netiomsgp->name.sa, netiomsgp->namelen) >= 0)
-		return netiomsgp->id;
+	sprintf(pkt, "*ack %u %s", nio->netiomsgp->id, msg);
+	if (sendto(nio->pubsockets[nio->netiomsgp->name.sa.sa_family]->fd, pkt, strlen(pkt), 0,
+				&nio->netiomsgp->name.sa, nio->netiomsgp->namelen) >= 0)
+		return nio->netiomsgp->id;
 	if (errno != ECONNREFUSED)
 		elog(LOG_WARNING, errno, "netio_ack_msg");
 	return -1;
@@ -816,30 +1070,80 @@ int netio_ack_msg(const char *msg)
 
 int netio_msg_pending(void)
 {
-	return netiomsgq ? 1 : 0;
+	return nio->netiomsgq ? 1 : 0;
 }
 
 unsigned int netio_msg_id(void)
 {
-	return netiomsgp ? netiomsgp->id : 0;
+	return nio->netiomsgp ? nio->netiomsgp->id : 0;
 }
 
 const char *netio_recv_msg(void)
 {
 	netio_ack_msg(netiomsg_ignored);
-	if (netiomsgp)
-		free(netiomsgp);
+	if (nio->netiomsgp)
+		free(nio->netiomsgp);
 	/* shift queue */
-	netiomsgp = netiomsgq;
-	if (!netiomsgp)
+	nio->netiomsgp = nio->netiomsgq;
+	if (!nio->netiomsgp)
 		return NULL;
 
-	netiomsgq = netiomsgq->next;
-	if (!netiomsgq)
-		netiomsgqlast = NULL;
-	netiomsg_acked = 0;
+	nio->netiomsgq = nio->netiomsgq->next;
+	if (!nio->netiomsgq)
+		nio->netiomsgqlast = NULL;
+	nio->netiomsg_acked = 0;
 
 	/* unlink current entry */
-	netiomsgp->next = NULL;
-	return netiomsgp->txt;
+	nio->netiomsgp->next = NULL;
+	return nio->netiomsgp->txt;
+}
+
+/* contexts */
+struct netio *netio_new(void)
+{
+	return zalloc(sizeof(struct netio));
+}
+
+void netio_use(struct netio *ctx)
+{
+	nio = ctx ?: &defnetio;
+}
+
+/* free the sockets & messages, the parameters are destroyed already */
+void netio_free(struct netio *ctx)
+{
+	struct netio *saved = nio;
+	struct iosocket *sk;
+	struct ioremote *remote;
+	struct netiomsg *msg;
+	int j;
+
+	nio = ctx;
+	for (j = 0; j < NIOSOCKETS*2; ++j) {
+		sk = (j < NIOSOCKETS) ? nio->iosockets[j] :
+			nio->pubsockets[j - NIOSOCKETS];
+		if (!sk)
+			continue;
+		while (sk->remotes) {
+			remote = sk->remotes;
+			sk->remotes = remote->next;
+			free(remote);
+		}
+		libe_remove_fd(sk->fd);
+		close(sk->fd);
+		free(sk);
+	}
+	if (nio->keepalive_scheduled)
+		libt_remove_timeout(netio_keepalive, nio);
+	free(nio->netiomsgp);
+	while (nio->netiomsgq) {
+		msg = nio->netiomsgq;
+		nio->netiomsgq = msg->next;
+		free(msg);
+	}
+	nio = (saved == ctx) ? &defnetio : saved;
+	if (ctx != &defnetio)
+		free(ctx);
+	else
+		memset(ctx, 0, sizeof(*ctx));
 }
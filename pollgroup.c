@@ -0,0 +1,199 @@
+#include <stdlib.h>
+
+#include "lib/libt.h"
+#include "_libio.h"
+
+/*
+ * periodic polls with the same delay share 1 timer,
+ * so they wake up once, and run one after the other
+ * An adaptive poll doubles its delay from min to max while stable,
+ * so members of equal min & max keep sharing groups.
+ * Groups belong to the loop that runs their timer.
+ */
+struct pollmember {
+	struct pollmember *next;
+	void (*fn)(void *dat);
+	void *dat;
+	double min, max;
+};
+
+struct pollgroup {
+	struct pollgroup *next;
+	double delay;
+	struct pollmember *members;
+	/* members are running, don't free */
+	int running;
+};
+
+static int free_pollgroup(struct pollgroup *grp);
+
+static void pollgroup_timeout(void *dat)
+{
+	struct pollgroup *grp = dat;
+	struct pollmember *mb, *next;
+
+	++grp->running;
+	for (mb = grp->members; mb; mb = next) {
+		/* a member may remove itself */
+		next = mb->next;
+		if (mb->fn)
+			mb->fn(mb->dat);
+	}
+	--grp->running;
+	if (!free_pollgroup(grp))
+		libt_repeat_timeout(grp->delay, pollgroup_timeout, grp);
+}
+
+/* drop removed members, and @grp when empty, return 1 when freed */
+static int free_pollgroup(struct pollgroup *grp)
+{
+	struct pollmember **pmb, *mb;
+	struct pollgroup **pgrp;
+
+	if (grp->running)
+		return 0;
+	for (pmb = &grp->members; *pmb; ) {
+		mb = *pmb;
+		if (mb->fn) {
+			pmb = &mb->next;
+			continue;
+		}
+		*pmb = mb->next;
+		free(mb);
+	}
+	if (grp->members)
+		return 0;
+	for (pgrp = libio_loop_pollgroups(); *pgrp; pgrp = &(*pgrp)->next) {
+		if (*pgrp == grp) {
+			*pgrp = grp->next;
+			break;
+		}
+	}
+	libt_remove_timeout(pollgroup_timeout, grp);
+	free(grp);
+	return 1;
+}
+
+static struct pollmember *find_pollmember(void (*fn)(void *), void *dat,
+		struct pollgroup **pgrp)
+{
+	struct pollgroup *grp;
+	struct pollmember *mb;
+
+	for (grp = *libio_loop_pollgroups(); grp; grp = grp->next) {
+		for (mb = grp->members; mb; mb = mb->next) {
+			if ((mb->fn == fn) && (mb->dat == dat)) {
+				*pgrp = grp;
+				return mb;
+			}
+		}
+	}
+	return NULL;
+}
+
+static void add_pollmember(double delay, double min, double max,
+		void (*fn)(void *), void *dat)
+{
+	struct pollgroup *grp, **groups = libio_loop_pollgroups();
+	struct pollmember *mb;
+
+	for (grp = *groups; grp; grp = grp->next) {
+		if (grp->delay == delay)
+			break;
+	}
+	if (!grp) {
+		grp = zalloc(sizeof(*grp));
+		grp->delay = delay;
+		grp->next = *groups;
+		*groups = grp;
+		libt_add_timeout_prio(delay, delay/4, LIBT_PRIO_LOW,
+				pollgroup_timeout, grp);
+	}
+	mb = zalloc(sizeof(*mb));
+	mb->fn = fn;
+	mb->dat = dat;
+	mb->min = min;
+	mb->max = max;
+	mb->next = grp->members;
+	grp->members = mb;
+}
+
+void libio_add_adaptive_poll(double min, double max, void (*fn)(void *), void *dat)
+{
+	struct pollgroup *grp;
+	struct pollmember *mb;
+
+	if (max < min)
+		max = min;
+	mb = find_pollmember(fn, dat, &grp);
+	if (mb) {
+		if ((mb->min == min) && (mb->max == max))
+			return;
+		libio_remove_poll(fn, dat);
+	}
+	add_pollmember(min, min, max, fn, dat);
+}
+
+void libio_add_poll(double delay, void (*fn)(void *), void *dat)
+{
+	libio_add_adaptive_poll(delay, delay, fn, dat);
+}
+
+double libio_poll_adapt(void (*fn)(void *), void *dat, int changed)
+{
+	struct pollgroup *grp;
+	struct pollmember *mb;
+	double delay, min, max;
+
+	mb = find_pollmember(fn, dat, &grp);
+	if (!mb)
+		return 0;
+	delay = changed ? mb->min : grp->delay*2;
+	if (delay > mb->max)
+		delay = mb->max;
+	if (delay != grp->delay) {
+		min = mb->min;
+		max = mb->max;
+		libio_remove_poll(fn, dat);
+		add_pollmember(delay, min, max, fn, dat);
+	}
+	return delay;
+}
+
+void libio_remove_poll(void (*fn)(void *), void *dat)
+{
+	struct pollgroup *grp;
+	struct pollmember *mb;
+
+	mb = find_pollmember(fn, dat, &grp);
+	if (!mb)
+		return;
+	/* free later, a running group may hold it */
+	mb->fn = NULL;
+	free_pollgroup(grp);
+}
+
+int libio_poll_exist(void (*fn)(void *), void *dat)
+{
+	struct pollgroup *grp;
+
+	return !!find_pollmember(fn, dat, &grp);
+}
+
+/* free the groups of a loop that goes away, with its timers */
+void free_pollgroups(struct pollgroup *groups)
+{
+	struct pollgroup *grp;
+	struct pollmember *mb;
+
+	while (groups) {
+		grp = groups;
+		groups = grp->next;
+		while (grp->members) {
+			mb = grp->members;
+			grp->members = mb->next;
+			free(mb);
+		}
+		free(grp);
+	}
+}
@@ -53,7 +53,7 @@ static int set_shared(struct iopar *iopar, double newvalue)
 	if (set_iopar(spar->master->refpar, newvalue) < 0)
 		return -1;
 	/* update myself */
-	spar->iopar.value = newvalue;
+	iopar_value(&spar->iopar) = newvalue;
 
 	if (icontribute && !spar->icontribute) {
 		/* add myself as contributing (active) client */
@@ -64,7 +64,7 @@ static int set_shared(struct iopar *iopar, double newvalue)
 	for (apar = spar->master->pars; apar; apar = apar->next) {
 		if (apar == spar)
 			continue;
-		apar->iopar.value = newvalue;
+		iopar_value(&apar->iopar) = newvalue;
 		iopar_set_dirty(&apar->iopar);
 	}
 
@@ -111,6 +111,11 @@ static void del_shared(struct iopar *iopar)
 	free(spar);
 }
 
+static const struct iopar_ops shared_ops = {
+	.del = del_shared,
+	.set = set_shared,
+};
+
 struct iopar *mkshared(char *cstr)
 {
 	struct sharedpar *spar;
@@ -135,8 +140,7 @@ struct iopar *mkshared(char *cstr)
 
 	spar = zalloc(sizeof(*spar));
 	spar->master = shared;
-	spar->iopar.del = del_shared;
-	spar->iopar.set = set_shared;
+	iopar_init(&spar->iopar, &shared_ops);
 	if (iopar_present(shared->refpar))
 		iopar_set_present(&spar->iopar);
 	++shared->refcnt;
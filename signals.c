@@ -0,0 +1,132 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <unistd.h>
+#include <sys/signalfd.h>
+
+#include "lib/libe.h"
+#include "_libio.h"
+
+/* signals, delivered synchronously via a signalfd in the main loop */
+struct sighandler {
+	struct sighandler *next;
+	int sig;
+	void (*fn)(int sig, void *dat);
+	void *dat;
+};
+
+static struct sighandler *sighandlers;
+static sigset_t sigmask;
+static int sigfd = -1;
+/* handlers are only marked for removal during dispatch */
+static int indispatch;
+
+static void purge_sighandlers(void)
+{
+	struct sighandler *h, **ph;
+
+	for (ph = &sighandlers; *ph; ) {
+		h = *ph;
+		if (!h->fn) {
+			*ph = h->next;
+			free(h);
+		} else
+			ph = &h->next;
+	}
+}
+
+static void read_signalfd(int fd, void *dat)
+{
+	struct signalfd_siginfo info;
+	struct sighandler *h;
+
+	++indispatch;
+	while (read(fd, &info, sizeof(info)) == sizeof(info)) {
+		for (h = sighandlers; h; h = h->next) {
+			if (h->fn && h->sig == info.ssi_signo)
+				h->fn(h->sig, h->dat);
+		}
+	}
+	if (!--indispatch)
+		purge_sighandlers();
+}
+
+static int update_signalfd(void)
+{
+	int ret;
+
+	ret = signalfd(sigfd, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (ret < 0) {
+		elog(LOG_WARNING, errno, "signalfd");
+		return ret;
+	}
+	if (sigfd < 0) {
+		sigfd = ret;
+		libe_add_fd(sigfd, read_signalfd, NULL);
+	}
+	return 0;
+}
+
+int libio_add_signal(int sig, void (*fn)(int sig, void *), void *dat)
+{
+	struct sighandler *h;
+	sigset_t set;
+
+	if (sigfd < 0)
+		sigemptyset(&sigmask);
+	if (!sigismember(&sigmask, sig)) {
+		sigaddset(&sigmask, sig);
+		if (update_signalfd() < 0) {
+			sigdelset(&sigmask, sig);
+			return -1;
+		}
+		/* block the signal, so it remains queued for the signalfd */
+		sigemptyset(&set);
+		sigaddset(&set, sig);
+		sigprocmask(SIG_BLOCK, &set, NULL);
+	}
+	h = zalloc(sizeof(*h));
+	h->sig = sig;
+	h->fn = fn;
+	h->dat = dat;
+	h->next = sighandlers;
+	sighandlers = h;
+	return 0;
+}
+
+int libio_del_signal(int sig, void (*fn)(int sig, void *), void *dat)
+{
+	struct sighandler *h;
+	sigset_t set;
+
+	for (h = sighandlers; h; h = h->next) {
+		if (h->sig == sig && h->fn == fn && h->dat == dat) {
+			h->fn = NULL;
+			goto found;
+		}
+	}
+	errno = ENOENT;
+	return -1;
+found:
+	if (!indispatch)
+		purge_sighandlers();
+	for (h = sighandlers; h; h = h->next) {
+		if (h->fn && h->sig == sig)
+			/* still in use */
+			return 0;
+	}
+	sigdelset(&sigmask, sig);
+	update_signalfd();
+	sigemptyset(&set);
+	sigaddset(&set, sig);
+	sigprocmask(SIG_UNBLOCK, &set, NULL);
+	return 0;
+}
+
+void libio_unblock_signals(void)
+{
+	if (sigfd >= 0)
+		sigprocmask(SIG_UNBLOCK, &sigmask, NULL);
+}
@@ -7,14 +7,18 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
 
 #include "lib/libt.h"
+#include "lib/libe.h"
 
 #include "_libio.h"
 
 static const char *const strflags[] = {
 	"delay",
 		#define ID_DELAY	0
+		#define FL_DELAY	(1 << ID_DELAY)
 	"invert",
 		#define ID_INVERT	1
 		#define FL_INVERT	(1 << ID_INVERT)
@@ -26,6 +30,13 @@ static const char *const strflags[] = {
 		#define ID_MULTIPLIER	4
 	"max",
 		#define ID_MAX		5
+	"notify",
+		#define ID_NOTIFY	6
+		#define FL_NOTIFY	(1 << ID_NOTIFY)
+	"adaptive",
+		#define ID_ADAPTIVE	7
+	"ttl",
+		#define ID_TTL		8
 	NULL,
 };
 
@@ -33,47 +44,48 @@ static const char *const strflags[] = {
 struct sysfspar {
 	struct iopar iopar;
 	long lastval;
+	/* last value read, before edge detection */
+	long lastraw;
 
 	int flags;
-	double delay;
+	/* poll interval, adaptive up to maxdelay */
+	double delay, maxdelay;
+	/* read on get only, when the last read is older than ttl */
+	double ttl, readtime;
 	double edge;
 	double hyst;
 	double mul;
 	char *sysfs;
 	char *realsysfs;
+	struct attr *attr;
+	/* fd watched for sysfs_notify(), -1 when not watched */
+	int pollfd;
 };
 
-static void sysfspar_read(struct sysfspar *sp, int warn)
+/* process a read of the attribute, return 1 when its value moved */
+static int sysfspar_parse(struct sysfspar *sp, const char *buf, int warn)
 {
-	int fd, ret;
+	int moved;
 	long ivalue;
 	double fvalue;
-	char buf[32], *str;
+	const char *str;
 
 	/* warn if requested, or param is present */
-	warn |= sp->iopar.state & ST_PRESENT;
+	warn |= iopar_state(&sp->iopar) & ST_PRESENT;
 
-	fd = open(sp->realsysfs, O_RDONLY);
-	if (fd < 0) {
-		/* avoid alerting too much */
-		if (warn)
-			elog(LOG_WARNING, errno, "open %s", sp->sysfs);
-		goto fail_open;
-	}
-	ret = read(fd, buf, sizeof(buf)-1);
-	if (ret < 0) {
+	if (!buf) {
 		/* avoid alerting too much */
 		if (warn)
 			elog(LOG_WARNING, errno, "read %s", sp->sysfs);
 		goto fail_read;
 	}
-	close(fd);
-	buf[ret] = 0;
 
 	str = strpbrk(buf, "01234567890+-.");
 	if (!str)
 		goto fail_parse;
 	ivalue = strtoul(str, NULL, 10);
+	moved = ivalue != sp->lastraw;
+	sp->lastraw = ivalue;
 	fvalue = ivalue * sp->mul;
 	if (!isnan(sp->edge)) {
 		/* boolean detection */
@@ -84,8 +96,8 @@ static void sysfspar_read(struct sysfspar *sp, int warn)
 			else if (fvalue < sp->edge - sp->hyst)
 				ivalue = 0;
 			else
-				/* remain the same */
-				return;
+				/* remain the same, and within the band is stable */
+				return 0;
 		} else {
 			ivalue = fvalue >= sp->edge;
 		}
@@ -93,28 +105,90 @@ static void sysfspar_read(struct sysfspar *sp, int warn)
 			ivalue = !ivalue;
 		fvalue = ivalue;
 	}
-	if (!(sp->iopar.state & ST_PRESENT) || (ivalue != sp->lastval)) {
+	if (!(iopar_state(&sp->iopar) & ST_PRESENT) || (ivalue != sp->lastval)) {
 		sp->lastval = ivalue;
-		sp->iopar.value = fvalue;
+		iopar_value(&sp->iopar) = fvalue;
 		iopar_set_dirty(&sp->iopar);
 	}
 	/* mark as present */
 	iopar_set_present(&sp->iopar);
-	return;
+	return moved;
 
 fail_read:
-	close(fd);
-fail_open:
 fail_parse:
 	iopar_clr_present(&sp->iopar);
+	return 0;
 }
 
-static void sysfspar_timeout(void *data)
+/* read the attribute now, return 1 when its value moved */
+static int sysfspar_read(struct sysfspar *sp, int warn)
+{
+	sp->readtime = libt_now();
+	return sysfspar_parse(sp, attr_pread(sp->attr), warn);
+}
+
+static void sysfspar_timeout(void *data);
+static void sysfspar_notified(int fd, void *data);
+
+/* follow the attribute's fd, it changes when the attribute is reopened */
+static void sysfspar_watch(struct sysfspar *sp)
+{
+	int fd = attr_fd(sp->attr);
+
+	if (fd == sp->pollfd)
+		return;
+	if (sp->pollfd >= 0)
+		libe_remove_fd(sp->pollfd);
+	sp->pollfd = -1;
+	if ((fd >= 0) && (libe_add_fd(fd, sysfspar_notified, sp) >= 0)) {
+		libe_mod_fd(fd, LIBE_PRI);
+		libe_set_prio(fd, LIBE_PRIO_HIGH);
+		sp->pollfd = fd;
+	} else
+		/* poll until the attribute can be watched again */
+		libio_add_adaptive_poll(sp->delay, sp->maxdelay, sysfspar_timeout, sp);
+}
+
+static void sysfspar_notified(int fd, void *data)
 {
 	struct sysfspar *sp = data;
 
+	/* reading rearms the notification */
 	sysfspar_read(sp, 0);
-	libt_repeat_timeout(sp->delay, sysfspar_timeout, sp);
+	sysfspar_watch(sp);
+}
+
+static void sysfspar_polled(const char *buf, void *data)
+{
+	struct sysfspar *sp = data;
+	int moved;
+
+	moved = sysfspar_parse(sp, buf, 0);
+	iopar_polled(&sp->iopar, libio_poll_adapt(sysfspar_timeout, sp, moved));
+	if (sp->flags & FL_NOTIFY) {
+		sysfspar_watch(sp);
+		if ((sp->pollfd >= 0) && !(sp->flags & FL_DELAY))
+			/* notifications took over */
+			libio_remove_poll(sysfspar_timeout, sp);
+	}
+}
+
+static void sysfspar_timeout(void *data)
+{
+	struct sysfspar *sp = data;
+
+	/* the reads of a poll group go out together */
+	sp->readtime = libt_now();
+	attr_pread_queue(sp->attr, sysfspar_polled, sp);
+}
+
+/* only sysfs attributes have sysfs_notify() */
+static int sysfs_notify_supported(struct sysfspar *sp)
+{
+	struct statfs st;
+
+	return (attr_fd(sp->attr) >= 0) && !fstatfs(attr_fd(sp->attr), &st) &&
+		(st.f_type == SYSFS_MAGIC);
 }
 
 static int set_sysfspar(struct iopar *iopar, double value)
@@ -122,36 +196,29 @@ static int set_sysfspar(struct iopar *iopar, double value)
 	struct sysfspar *sp = (struct sysfspar *)iopar;
 	int ret;
 	long ivalue;
-	FILE *fp;
 
 	/* NAN may be passed to release control */
 	if (isnan(value))
 		value = 0;
 
-	fp = fopen(sp->realsysfs, "w");
-	if (!fp) {
-		if (sp->iopar.state & ST_PRESENT)
-			elog(LOG_WARNING, errno, "fopen %s", sp->sysfs);
-		goto fail_open;
-	}
-
 	ivalue = value * 1e3;
-	ret = fprintf(fp, "%lu", ivalue);
+	ret = attr_pwritef(sp->attr, "%lu", ivalue);
 	if (ret < 0) {
-		if (sp->iopar.state & ST_PRESENT)
-			elog(LOG_WARNING, errno, "fwrite %s", sp->sysfs);
+		if (iopar_state(&sp->iopar) & ST_PRESENT)
+			elog(LOG_WARNING, errno, "write %s", sp->sysfs);
 		goto fail_write;
 	}
-	fclose(fp);
-	sp->iopar.value = value;
+	iopar_value(&sp->iopar) = value;
 	sp->lastval = ivalue;
 	iopar_set_present(&sp->iopar);
+	if (sp->flags & FL_NOTIFY)
+		sysfspar_watch(sp);
 	return ret;
 
 fail_write:
-	fclose(fp);
-fail_open:
 	iopar_clr_present(&sp->iopar);
+	if (sp->flags & FL_NOTIFY)
+		sysfspar_watch(sp);
 	return -1;
 }
 
@@ -159,23 +226,50 @@ static void del_sysfspar(struct iopar *iopar)
 {
 	struct sysfspar *sp = (void *)iopar;
 
-	libt_remove_timeout(sysfspar_timeout, sp);
+	libio_remove_poll(sysfspar_timeout, sp);
+	if (sp->pollfd >= 0)
+		libe_remove_fd(sp->pollfd);
 	cleanup_libiopar(&sp->iopar);
+	attr_close(sp->attr);
 	free(sp->sysfs);
 	if (sp->realsysfs)
 		free(sp->realsysfs);
 	free(sp);
 }
 
+static const struct iopar_ops sysfspar_ops = {
+	.del = del_sysfspar,
+	.set = set_sysfspar,
+};
+
+/* read through, when the cached value is older than ttl */
+static void get_sysfspar_ttl(struct iopar *iopar)
+{
+	struct sysfspar *sp = (void *)iopar;
+
+	if (libt_now() < sp->readtime + sp->ttl) {
+		iopar_cache_hit(&sp->iopar);
+		return;
+	}
+	sysfspar_read(sp, 0);
+	iopar_polled(&sp->iopar, 0);
+}
+
+static const struct iopar_ops sysfspar_ttl_ops = {
+	.del = del_sysfspar,
+	.set = set_sysfspar,
+	.jitget = get_sysfspar_ttl,
+};
+
 struct iopar *mksysfspar(char *spec)
 {
 	struct sysfspar *sp;
 	const char *tok;
+	char *endp;
 	int flag;
 
 	sp = zalloc(sizeof(*sp) + strlen(spec));
-	sp->iopar.del = del_sysfspar;
-	sp->iopar.set = set_sysfspar;
+	iopar_init(&sp->iopar, &sysfspar_ops);
 	/* force the first read to mark value as dirty */
 	sp->sysfs = strdup(strtok(spec, ",") ?: "/dev/null");
 	sp->realsysfs = findfile(sp->sysfs);
@@ -185,6 +279,9 @@ struct iopar *mksysfspar(char *spec)
 		free(sp);
 		return NULL;
 	}
+	/* outputs are read back too, when the attribute allows */
+	sp->attr = attr_open(sp->realsysfs, O_RDWR);
+	sp->pollfd = -1;
 	sp->edge = NAN;
 	sp->hyst = NAN;
 	sp->delay = 1;
@@ -200,6 +297,7 @@ struct iopar *mksysfspar(char *spec)
 		switch (flag) {
 		case ID_DELAY:
 			sp->delay = strtod(mygetsuboptvalue() ?: "1", NULL);
+			sp->flags |= FL_DELAY;
 			break;
 		case ID_INVERT:
 			sp->flags |= FL_INVERT;
@@ -216,17 +314,45 @@ struct iopar *mksysfspar(char *spec)
 		case ID_MAX:
 			sp->mul = 1 / strtod(mygetsuboptvalue() ?: "1", NULL);
 			break;
+		case ID_ADAPTIVE:
+			/* MIN:MAX */
+			tok = mygetsuboptvalue() ?: "1:60";
+			sp->delay = strtod(tok, &endp);
+			sp->maxdelay = (*endp == ':') ? strtod(endp+1, NULL) : 60;
+			sp->flags |= FL_DELAY;
+			break;
+		case ID_TTL:
+			sp->ttl = strtod(mygetsuboptvalue() ?: "1", NULL);
+			break;
 		default:
 			sp->flags |= 1 << flag;
 			break;
 		}
 	}
 
+	if (sp->maxdelay < sp->delay)
+		sp->maxdelay = sp->delay;
+	if (sp->ttl > 0) {
+		/* on demand, instead of polling or notify */
+		iopar_set_ops(&sp->iopar, &sysfspar_ttl_ops);
+		sp->flags &= ~FL_NOTIFY;
+		sysfspar_read(sp, 1);
+		return &sp->iopar;
+	}
+	if ((sp->flags & FL_NOTIFY) && !sysfs_notify_supported(sp)) {
+		elog(LOG_NOTICE, 0, "%s: no sysfs notify, polling", sp->sysfs);
+		sp->flags &= ~FL_NOTIFY;
+	}
 	/* read initial value & schedule next */
 	if (!access(sp->realsysfs, R_OK)) {
-		/* read repeatedly */
 		sysfspar_read(sp, 1);
-		libt_add_timeout(sp->delay, sysfspar_timeout, sp);
+		if (sp->flags & FL_NOTIFY)
+			/* read on notification, poll only when a delay is given */
+			sysfspar_watch(sp);
+		if (!(sp->flags & FL_NOTIFY) || (sp->flags & FL_DELAY))
+			/* read repeatedly */
+			libio_add_adaptive_poll(sp->delay, sp->maxdelay,
+					sysfspar_timeout, sp);
 	}
 	return &sp->iopar;
 }
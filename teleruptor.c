@@ -32,9 +32,9 @@ static void teleruptor_update(struct tr *tr)
 	if (!iopar_present(tr->fdb))
 		return;
 
-	saved_value = tr->iopar.value;
-	tr->iopar.value = get_iopar(tr->fdb);
-	if (tobool(saved_value) != tobool(tr->iopar.value))
+	saved_value = iopar_value(&tr->iopar);
+	iopar_value(&tr->iopar) = get_iopar(tr->fdb);
+	if (tobool(saved_value) != tobool(iopar_value(&tr->iopar)))
 		iopar_set_dirty(&tr->iopar);
 	iopar_set_present(&tr->iopar);
 }
@@ -46,7 +46,7 @@ static void teleruptor_handler(void *dat)
 	switch (tr->state) {
 	case ST_WAIT:
 		teleruptor_update(tr);
-		if (tobool(tr->iopar.value) == tr->newvalue) {
+		if (tobool(iopar_value(&tr->iopar)) == tr->newvalue) {
 			/* no problem */
 			tr->state = ST_IDLE;
 			break;
@@ -60,14 +60,14 @@ static void teleruptor_handler(void *dat)
 	case ST_IDLE:
 		/* activate teleruptor */
 		set_iopar(tr->out, 1);
-		libt_add_timeout(0.200, teleruptor_handler, tr);
+		libt_add_timeout_prio(0.200, 0, LIBT_PRIO_HIGH, teleruptor_handler, tr);
 		tr->state = ST_SET;
 		++tr->retries;
 		break;
 	case ST_SET:
 		/* release teleruptor */
 		set_iopar(tr->out, 0);
-		libt_add_timeout(0.200, teleruptor_handler, tr);
+		libt_add_timeout_prio(0.200, 0, LIBT_PRIO_HIGH, teleruptor_handler, tr);
 
 		teleruptor_update(tr);
 		tr->state = ST_WAIT;
@@ -83,7 +83,7 @@ static int set_teleruptor(struct iopar *iopar, double newvalue)
 	tr->retries = 0;
 	if (tr->state == ST_IDLE) {
 		teleruptor_update(tr);
-		if (tr->newvalue != tobool(tr->iopar.value))
+		if (tr->newvalue != tobool(iopar_value(&tr->iopar)))
 			/* change required */
 			teleruptor_handler(tr);
 	}
@@ -114,15 +114,19 @@ static void teleruptor_feedback(void *dat)
 		teleruptor_update(tr);
 }
 
+static const struct iopar_ops teleruptor_ops = {
+	.del = del_teleruptor,
+	.set = set_teleruptor,
+};
+
 struct iopar *mkteleruptor(char *str)
 {
 	struct tr *tr;
 	char *savedstr;
 
 	tr = zalloc(sizeof(*tr));
-	tr->iopar.del = del_teleruptor;
-	tr->iopar.set = set_teleruptor;
-	tr->iopar.value = FP_NAN;
+	iopar_init(&tr->iopar, &teleruptor_ops);
+	iopar_value(&tr->iopar) = FP_NAN;
 
 	tr->out = create_iopar(strtok_r(str, "+", &savedstr));
 	if (tr->out < 0)
@@ -0,0 +1,234 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <math.h>
+
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include "lib/libe.h"
+#include "_libio.h"
+
+/*
+ * concurrent access to a registry
+ * The loop thread publishes each value & state in a seqlock'd slot,
+ * other threads read those slots without locking.
+ * Writes from other threads are pushed on a lock-free stack,
+ * which the loop thread takes over at once and applies in order.
+ */
+struct pubslot {
+	unsigned int seq;
+	/* -1 for unused slots */
+	int state;
+	double value;
+};
+
+struct pubtable {
+	/* tables that were replaced, readers may still use them */
+	struct pubtable *retired;
+	int size;
+	struct pubslot slots[];
+};
+
+struct postedwrite {
+	struct postedwrite *next;
+	int id;
+	double value;
+};
+
+struct libio_shared {
+	struct pubtable *pub;
+	struct postedwrite *writes;
+	int wakefd;
+};
+
+static struct pubtable *new_pubtable(int size)
+{
+	struct pubtable *pub;
+	int j;
+
+	pub = zalloc(sizeof(*pub) + size*sizeof(pub->slots[0]));
+	pub->size = size;
+	for (j = 0; j < size; ++j)
+		pub->slots[j].state = -1;
+	return pub;
+}
+
+/* publish @value & @state in the slot of @iopar_id */
+static void store_pubslot(int iopar_id, double value, int state)
+{
+	struct libio_shared *sh = libio_reg->shared;
+	struct pubtable *pub = sh->pub, *grown;
+	struct pubslot *slot;
+	unsigned int seq;
+
+	if (iopar_id >= pub->size) {
+		/* readers may still hold the old table, keep it until free */
+		grown = new_pubtable(libio_reg->tablesize);
+		memcpy(grown->slots, pub->slots, pub->size*sizeof(pub->slots[0]));
+		grown->retired = pub;
+		__atomic_store_n(&sh->pub, grown, __ATOMIC_RELEASE);
+		pub = grown;
+	}
+	slot = &pub->slots[iopar_id];
+	seq = slot->seq + 1;
+	__atomic_store_n(&slot->seq, seq, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store(&slot->value, &value, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->state, state, __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+void libio_publish(int iopar_id)
+{
+	if (libio_reg->table[iopar_id])
+		store_pubslot(iopar_id, libio_reg->values[iopar_id],
+				libio_reg->states[iopar_id] & ST_PRESENT);
+	else
+		store_pubslot(iopar_id, NAN, -1);
+}
+
+void libio_apply_posted(void)
+{
+	struct libio_shared *sh = libio_reg->shared;
+	struct postedwrite *w, *fifo = NULL;
+
+	/* take the whole stack, and reverse it into posting order */
+	w = __atomic_exchange_n(&sh->writes, NULL, __ATOMIC_ACQUIRE);
+	while (w) {
+		struct postedwrite *next = w->next;
+
+		w->next = fifo;
+		fifo = w;
+		w = next;
+	}
+	while (fifo) {
+		w = fifo;
+		fifo = fifo->next;
+		if (set_iopar(w->id, w->value) < 0)
+			elog(LOG_NOTICE, errno, "posted set %s=%lf",
+					iopar_name(w->id) ?: "?", w->value);
+		free(w);
+	}
+}
+
+static void read_wakefd(int fd, void *dat)
+{
+	uint64_t count;
+
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		elog(LOG_ERR, errno, "read eventfd");
+	libio_apply_posted();
+}
+
+int libio_share_registry(void)
+{
+	struct libio_shared *sh;
+	int j;
+
+	if (libio_reg->shared)
+		return 0;
+	sh = zalloc(sizeof(*sh));
+	sh->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (sh->wakefd < 0) {
+		elog(LOG_ERR, errno, "eventfd");
+		goto fail_eventfd;
+	}
+	if (libe_add_fd(sh->wakefd, read_wakefd, NULL) < 0)
+		goto fail_add;
+	sh->pub = new_pubtable(libio_reg->tablesize ?: 16);
+	libio_reg->shared = sh;
+	for (j = 0; j < libio_reg->tablesize; ++j)
+		libio_publish(j);
+	return 0;
+
+fail_add:
+	close(sh->wakefd);
+fail_eventfd:
+	free(sh);
+	return -1;
+}
+
+void libio_shared_free(struct libio_shared *sh)
+{
+	struct pubtable *pub;
+	struct postedwrite *w;
+
+	if (!sh)
+		return;
+	libe_remove_fd(sh->wakefd);
+	close(sh->wakefd);
+	while (sh->pub) {
+		pub = sh->pub;
+		sh->pub = pub->retired;
+		free(pub);
+	}
+	while (sh->writes) {
+		w = sh->writes;
+		sh->writes = w->next;
+		free(w);
+	}
+	free(sh);
+}
+
+int peek_iopar(int iopar_id, double *value)
+{
+	struct libio_shared *sh = libio_reg->shared;
+	struct pubtable *pub;
+	struct pubslot *slot;
+	unsigned int seq;
+	int state;
+	double v;
+
+	if (!sh) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	pub = __atomic_load_n(&sh->pub, __ATOMIC_ACQUIRE);
+	if ((iopar_id < 0) || (iopar_id >= pub->size)) {
+		errno = ENODEV;
+		return -1;
+	}
+	slot = &pub->slots[iopar_id];
+	do {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		__atomic_load(&slot->value, &v, __ATOMIC_RELAXED);
+		state = __atomic_load_n(&slot->state, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || (seq != __atomic_load_n(&slot->seq, __ATOMIC_RELAXED)));
+
+	if (state < 0) {
+		errno = ENODEV;
+		return -1;
+	}
+	if (value)
+		*value = v;
+	return state ? 1 : 0;
+}
+
+int post_iopar(int iopar_id, double value)
+{
+	struct libio_shared *sh = libio_reg->shared;
+	struct postedwrite *w, *head;
+	uint64_t one = 1;
+
+	if (!sh) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	w = zalloc(sizeof(*w));
+	w->id = iopar_id;
+	w->value = value;
+	head = __atomic_load_n(&sh->writes, __ATOMIC_RELAXED);
+	do
+		w->next = head;
+	while (!__atomic_compare_exchange_n(&sh->writes, &head, w, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	/* w may be applied already, the first write after a drain wakes the loop */
+	if (!head && write(sh->wakefd, &one, sizeof(one)) < 0) {
+		elog(LOG_ERR, errno, "write eventfd");
+		return -1;
+	}
+	return 0;
+}
@@ -46,7 +46,7 @@ static int set_virtual(struct iopar *iopar, double value)
 	else
 		state &= ~(virt->mask);
 
-	virt->iopar.value = value;
+	iopar_value(&virt->iopar) = value;
 	prn_virtual_state(virt->mask);
 	return 0;
 }
@@ -55,7 +55,7 @@ static void get_virtual(struct iopar *iopar)
 {
 	struct virtualpar *virt = (struct virtualpar *)iopar;
 
-	virt->iopar.value = (state & virt->mask) ? 1 : 0;
+	iopar_value(&virt->iopar) = (state & virt->mask) ? 1 : 0;
 }
 
 static void del_virtual(struct iopar *iopar)
@@ -66,6 +66,12 @@ static void del_virtual(struct iopar *iopar)
 	free(virt);
 }
 
+static const struct iopar_ops virtual_ops = {
+	.del = del_virtual,
+	.set = set_virtual,
+	.jitget = get_virtual,
+};
+
 struct iopar *mkvirtual(char *str)
 {
 	struct virtualpar *virt;
@@ -76,9 +82,7 @@ struct iopar *mkvirtual(char *str)
 	if (*endp)
 		virt->mask2 = 1 << strtoul(endp+1, &endp, 0);
 
-	virt->iopar.del = del_virtual;
-	virt->iopar.set = set_virtual;
-	virt->iopar.jitget = get_virtual;
+	iopar_init(&virt->iopar, &virtual_ops);
 	iopar_set_present(&virt->iopar);
 
 	return &virt->iopar;
@@ -106,12 +110,18 @@ static int set_virtual_teleruptor(struct iopar *iopar, double value)
 	return ret;
 }
 
+static const struct iopar_ops virtual_teleruptor_ops = {
+	.del = del_virtual,
+	.set = set_virtual_teleruptor,
+	.jitget = get_virtual,
+};
+
 struct iopar *mkvirtualteleruptor(char *str)
 {
 	struct iopar *iopar;
 
 	iopar = mkvirtual(str);
 	if (iopar)
-		iopar->set = set_virtual_teleruptor;
+		iopar_set_ops(iopar, &virtual_teleruptor_ops);
 	return iopar;
 }